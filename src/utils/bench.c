@@ -0,0 +1,340 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Microbenchmarks for the utils.
+ *
+ * Results are printed as CSV, one line per measurement:
+ *   suite,case,key,bucket_bits,load_factor,count,ns_per_op,p50_ns,p99_ns
+ *
+ * ns_per_op is the mean over batches of count operations, repeated until at least
+ * MIN_BATCH_OPS operations ran. p50_ns and p99_ns come from timing
+ * up to LATENCY_SAMPLES operations one by one, and include the clock overhead. Columns which do
+ * not apply to a suite are left empty. */
+
+#define LATENCY_SAMPLES		4096
+#define STRING_KEY_SIZE		40
+#define MIN_BATCH_OPS		(1 << 16)
+
+typedef enum bench_key		bench_key_t;
+
+enum bench_key {
+	BENCH_KEY_INT32,
+	BENCH_KEY_INT64,
+	BENCH_KEY_STRING,
+};
+
+static const char *key_names[] = { "int32", "int64", "string" };
+
+static volatile uintptr_t	sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *suite, const char *name, const char *key, int bucket_bits, double load_factor,
+	   uint32_t count, uint64_t total_ns, uint64_t *samples, uint32_t sample_count)
+{
+	printf("%s,%s,%s,", suite, name, key ? key : "");
+
+	if (bucket_bits >= 0)
+		printf("%d,%.2f,", bucket_bits, load_factor);
+	else
+		printf(",,");
+
+	printf("%u,%.2f,", count, (double)total_ns / count);
+
+	if (sample_count) {
+		qsort(samples, sample_count, sizeof(uint64_t), compare_u64);
+		printf("%llu,%llu\n", (unsigned long long)samples[sample_count / 2],
+			   (unsigned long long)samples[sample_count * 99 / 100]);
+	} else {
+		printf(",\n");
+	}
+}
+
+/* Keys are stored back to back, key i at keys + i * key_size. */
+static void *
+make_keys(bench_key_t type, uint32_t count, size_t *key_size)
+{
+	char		*keys;
+	uint32_t	 i;
+
+	*key_size = type == BENCH_KEY_INT32 ? 4 : type == BENCH_KEY_INT64 ? 8 : STRING_KEY_SIZE;
+
+	keys = malloc(count * *key_size);
+	if (!keys)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		void *key = keys + i * *key_size;
+
+		/* Spread the keys like handles or pointers would be. */
+		if (type == BENCH_KEY_INT32)
+			*(uint32_t *)key = i * 2654435761u;
+		else if (type == BENCH_KEY_INT64)
+			*(uint64_t *)key = 0x7f0000000000ull + (uint64_t)i * 64;
+		else
+			snprintf(key, STRING_KEY_SIZE, "VK_KHR_bench_extension_%u", i);
+	}
+
+	return keys;
+}
+
+static vk_map_t *
+create_map(bench_key_t type, int bucket_bits)
+{
+	switch (type) {
+	case BENCH_KEY_INT32:
+		return vk_map_int32_create(bucket_bits);
+	case BENCH_KEY_INT64:
+		return vk_map_int64_create(bucket_bits);
+	default:
+		return vk_map_string_create(bucket_bits);
+	}
+}
+
+static void
+bench_map(bench_key_t type, int bucket_bits, double load_factor)
+{
+	uint32_t	 count = (uint32_t)((1 << bucket_bits) * load_factor);
+	uint32_t	 sample_count = MIN(count, LATENCY_SAMPLES);
+	uint64_t	*samples;
+	size_t		 key_size;
+	char		*keys, *misses;
+	vk_map_t	*map;
+	uint64_t	 start, end, total;
+	uint32_t	 reps = MAX(1, MIN_BATCH_OPS / MAX(count, 1));
+	uint32_t	 i, r;
+
+	if (count == 0)
+		return;
+
+	keys = make_keys(type, count * 2, &key_size);
+	samples = malloc(sample_count * sizeof(uint64_t));
+	if (!keys || !samples)
+		goto done;
+
+	/* The second half of the keys is never inserted. */
+	misses = keys + count * key_size;
+
+	/* set: inserting into a fresh map, growth included. */
+	total = 0;
+	for (r = 0; r < reps; r++) {
+		map = create_map(type, bucket_bits);
+		start = now_ns();
+		for (i = 0; i < count; i++)
+			vk_map_set(map, keys + i * key_size, keys + i * key_size, NULL);
+		total += now_ns() - start;
+		vk_map_destroy(map);
+	}
+
+	map = create_map(type, bucket_bits);
+	for (i = 0; i < sample_count; i++) {
+		start = now_ns();
+		vk_map_set(map, keys + i * key_size, keys + i * key_size, NULL);
+		samples[i] = now_ns() - start;
+	}
+	vk_map_destroy(map);
+
+	report("map", "set", key_names[type], bucket_bits, load_factor, count, total / reps,
+		   samples, sample_count);
+
+	map = create_map(type, bucket_bits);
+	for (i = 0; i < count; i++)
+		vk_map_set(map, keys + i * key_size, keys + i * key_size, NULL);
+
+	/* get_hit */
+	start = now_ns();
+	for (r = 0; r < reps; r++) {
+		for (i = 0; i < count; i++)
+			sink += (uintptr_t)vk_map_get(map, keys + i * key_size);
+	}
+	total = now_ns() - start;
+
+	for (i = 0; i < sample_count; i++) {
+		start = now_ns();
+		sink += (uintptr_t)vk_map_get(map, keys + i * key_size);
+		samples[i] = now_ns() - start;
+	}
+
+	report("map", "get_hit", key_names[type], bucket_bits, load_factor, count, total / reps,
+		   samples, sample_count);
+
+	/* get_miss */
+	start = now_ns();
+	for (r = 0; r < reps; r++) {
+		for (i = 0; i < count; i++)
+			sink += (uintptr_t)vk_map_get(map, misses + i * key_size);
+	}
+	total = now_ns() - start;
+
+	for (i = 0; i < sample_count; i++) {
+		start = now_ns();
+		sink += (uintptr_t)vk_map_get(map, misses + i * key_size);
+		samples[i] = now_ns() - start;
+	}
+
+	report("map", "get_miss", key_names[type], bucket_bits, load_factor, count, total / reps,
+		   samples, sample_count);
+
+	/* remove */
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		vk_map_set(map, keys + i * key_size, NULL, NULL);
+	end = now_ns();
+
+	report("map", "remove", key_names[type], bucket_bits, load_factor, count, end - start,
+		   NULL, 0);
+
+	vk_map_destroy(map);
+
+done:
+	free(samples);
+	free(keys);
+}
+
+static void
+bench_list(uint32_t count)
+{
+	vk_list_t	 head;
+	vk_list_t	*elms, *pos;
+	uint64_t	 start, end;
+	uint32_t	 i;
+
+	elms = calloc(count, sizeof(vk_list_t));
+	if (!elms)
+		return;
+
+	vk_list_init(&head);
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		vk_list_insert(&head, &elms[i]);
+	end = now_ns();
+	report("list", "insert", NULL, -1, 0, count, end - start, NULL, 0);
+
+	start = now_ns();
+	vk_list_for_each_list(pos, &head)
+		sink += (uintptr_t)pos;
+	end = now_ns();
+	report("list", "iterate", NULL, -1, 0, count, end - start, NULL, 0);
+
+	/* Remove in insertion order, i.e. from the tail. */
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		vk_list_remove(&elms[i]);
+	end = now_ns();
+	report("list", "remove", NULL, -1, 0, count, end - start, NULL, 0);
+
+	free(elms);
+}
+
+static void
+bench_hash(uint32_t count)
+{
+	static const int	 lengths[] = { 8, 32, 128 };
+	char				 name[32];
+	char				 str[128];
+	uint64_t			 start, end;
+	uint32_t			 i, j;
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		sink += vk_hash32(i);
+	end = now_ns();
+	report("hash", "hash32", "int32", -1, 0, count, end - start, NULL, 0);
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		sink += vk_hash64((uint64_t)i << 6);
+	end = now_ns();
+	report("hash", "hash64", "int64", -1, 0, count, end - start, NULL, 0);
+
+	memset(str, 'a', sizeof(str));
+
+	for (j = 0; j < ARRAY_LENGTH(lengths); j++) {
+		start = now_ns();
+		for (i = 0; i < count; i++) {
+			str[0] = (char)i;
+			sink += vk_hash_string_wy(str, lengths[j]);
+		}
+		end = now_ns();
+
+		snprintf(name, sizeof(name), "string_wy_%d", lengths[j]);
+		report("hash", name, "string", -1, 0, count, end - start, NULL, 0);
+
+		start = now_ns();
+		for (i = 0; i < count; i++) {
+			str[0] = (char)i;
+			sink += vk_hash_string_hsieh(str, lengths[j]);
+		}
+		end = now_ns();
+
+		snprintf(name, sizeof(name), "string_hsieh_%d", lengths[j]);
+		report("hash", name, "string", -1, 0, count, end - start, NULL, 0);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int	 bucket_bits[] = { 4, 8, 12, 16 };
+	static const double	 load_factors[] = { 0.25, 0.5, 0.75, 2.0 };
+	uint32_t			 i, j, k;
+
+	printf("suite,case,key,bucket_bits,load_factor,count,ns_per_op,p50_ns,p99_ns\n");
+
+	for (i = BENCH_KEY_INT32; i <= BENCH_KEY_STRING; i++) {
+		for (j = 0; j < ARRAY_LENGTH(bucket_bits); j++) {
+			for (k = 0; k < ARRAY_LENGTH(load_factors); k++)
+				bench_map(i, bucket_bits[j], load_factors[k]);
+		}
+	}
+
+	bench_list(1 << 16);
+	bench_hash(1 << 20);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* Stress test for vk_cmap, built and run by "make check-cmap".
+ *
+ * Reader threads look keys up in a loop while the main thread keeps inserting, replacing,
+ * removing and growing. Data encodes its key, so a reader can tell a torn or misplaced entry.
+ * Stable keys are never removed and must always be found. Churn keys come and go and may or
+ * may not be found, but must never carry another key's data. Exits non-zero on any failure. */
+#define STRESS_READERS		4
+#define STRESS_KEYS			20000
+#define STRESS_ROUNDS		30
+
+static vk_cmap_t	*map;
+static int			 stop;
+static uint64_t		 errors;
+
+static void *
+key_data(uint64_t key, uint32_t generation)
+{
+	return (void *)(uintptr_t)((key << 9) | ((generation & 0xff) << 1) | 1);
+}
+
+static vk_bool_t
+is_stable(uint64_t key)
+{
+	return key < STRESS_KEYS / 2 && key % 2 == 0;
+}
+
+static void *
+reader_main(void *data)
+{
+	uint64_t local_errors = 0;
+	uint64_t key;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		for (key = 0; key < STRESS_KEYS; key++) {
+			uintptr_t found = (uintptr_t)vk_cmap_get(map, key);
+
+			if (found && found >> 9 != key)
+				local_errors++;
+
+			if (!found && is_stable(key))
+				local_errors++;
+		}
+	}
+
+	__atomic_add_fetch(&errors, local_errors, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t	readers[STRESS_READERS];
+	uint32_t	round, i;
+	uint64_t	key;
+
+	/* Start small so that the table grows under the readers. */
+	map = vk_cmap_create(1);
+	if (!map) {
+		fprintf(stderr, "vk_cmap_create() failed\n");
+		return 1;
+	}
+
+	for (key = 0; key < STRESS_KEYS; key++) {
+		if (is_stable(key))
+			vk_cmap_set(map, key, key_data(key, 0));
+	}
+
+	for (i = 0; i < STRESS_READERS; i++) {
+		if (pthread_create(&readers[i], NULL, reader_main, NULL)) {
+			fprintf(stderr, "pthread_create() failed\n");
+			return 1;
+		}
+	}
+
+	for (round = 0; round < STRESS_ROUNDS; round++) {
+		for (key = 0; key < STRESS_KEYS; key++) {
+			if (!is_stable(key))
+				vk_cmap_set(map, key, key_data(key, round));
+		}
+
+		/* Replace stable data in place. */
+		for (key = 0; key < STRESS_KEYS; key += 2) {
+			if (is_stable(key))
+				vk_cmap_set(map, key, key_data(key, round + 1));
+		}
+
+		for (key = 0; key < STRESS_KEYS; key++) {
+			if (!is_stable(key))
+				vk_cmap_remove(map, key);
+		}
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < STRESS_READERS; i++)
+		pthread_join(readers[i], NULL);
+
+	for (key = 0; key < STRESS_KEYS; key++) {
+		if (!is_stable(key) && vk_cmap_get(map, key))
+			errors++;
+		if (is_stable(key) && vk_cmap_get(map, key) != key_data(key, STRESS_ROUNDS))
+			errors++;
+	}
+
+	vk_cmap_destroy(map, NULL);
+
+	printf("cmap stress: %d readers, %d keys, %d rounds, %llu errors\n", STRESS_READERS,
+		   STRESS_KEYS, STRESS_ROUNDS, (unsigned long long)errors);
+
+	return errors ? 1 : 0;
+}
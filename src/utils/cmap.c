@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Concurrent map from 64-bit integer keys to non-NULL pointers.
+ *
+ * Readers never lock. Writers are serialised by a mutex and publish their changes so that a
+ * reader either sees a consistent table or notices it raced with a writer:
+ *
+ * - Inserting fills an empty slot, storing the key before releasing the data. A slot with NULL
+ *   data is empty, so a reader sees either no entry or a complete one.
+ * - Replacing data is a single pointer store.
+ * - Deleting shifts following entries back, which may briefly hide an entry from a reader. It
+ *   is done inside a seqlock write section, and readers retry when the sequence changed.
+ * - Growing builds a new table and publishes it with a single pointer store. Readers may still
+ *   be walking the old tables, so they count themselves in map->readers for the length of a
+ *   lookup, and writers free the retired tables once they see no reader. A reader counted after
+ *   that check loads the new table, since both sides use sequentially consistent operations.
+ */
+
+typedef struct vk_cmap_slot		vk_cmap_slot_t;
+typedef struct vk_cmap_table	vk_cmap_table_t;
+
+struct vk_cmap_slot {
+	uint64_t	 key;
+	void		*data;
+};
+
+struct vk_cmap_table {
+	vk_cmap_table_t	*retired;
+	uint32_t		 mask;
+	vk_cmap_slot_t	 slots[];
+};
+
+struct vk_cmap {
+	vk_cmap_table_t	*table;
+	uint32_t		 seq;
+	uint32_t		 count;
+	uint32_t		 readers;
+	pthread_mutex_t	 mutex;
+};
+
+static vk_cmap_table_t *
+cmap_table_create(int bucket_bits)
+{
+	vk_cmap_table_t	*table;
+	uint32_t		 size = 1u << bucket_bits;
+
+	table = calloc(1, sizeof(vk_cmap_table_t) + size * sizeof(vk_cmap_slot_t));
+	VK_CHECK(table, return NULL, "calloc() failed.\n");
+
+	table->mask = size - 1;
+	return table;
+}
+
+static inline uint32_t
+cmap_index(const vk_cmap_table_t *table, uint64_t key)
+{
+	return (uint32_t)vk_hash64(key) & table->mask;
+}
+
+/* Must be called with the mutex held. */
+static int64_t
+cmap_find(const vk_cmap_table_t *table, uint64_t key)
+{
+	uint32_t index = cmap_index(table, key);
+	uint32_t i;
+
+	for (i = 0; i <= table->mask; i++) {
+		const vk_cmap_slot_t *slot = &table->slots[index];
+
+		if (!slot->data)
+			return -1;
+
+		if (slot->key == key)
+			return index;
+
+		index = (index + 1) & table->mask;
+	}
+
+	return -1;
+}
+
+/* Must be called with the mutex held, and the key known to be absent. */
+static void
+cmap_place(vk_cmap_table_t *table, uint64_t key, void *data)
+{
+	uint32_t index = cmap_index(table, key);
+
+	while (table->slots[index].data)
+		index = (index + 1) & table->mask;
+
+	__atomic_store_n(&table->slots[index].key, key, __ATOMIC_RELAXED);
+	__atomic_store_n(&table->slots[index].data, data, __ATOMIC_RELEASE);
+}
+
+static vk_bool_t
+cmap_grow(vk_cmap_t *map)
+{
+	vk_cmap_table_t	*old = map->table;
+	vk_cmap_table_t	*table;
+	uint32_t		 i;
+	int				 bucket_bits = __builtin_ctz(old->mask + 1) + 1;
+
+	table = cmap_table_create(bucket_bits);
+	if (!table)
+		return VK_FALSE;
+
+	for (i = 0; i <= old->mask; i++) {
+		if (old->slots[i].data)
+			cmap_place(table, old->slots[i].key, old->slots[i].data);
+	}
+
+	table->retired = old;
+	__atomic_store_n(&map->table, table, __ATOMIC_SEQ_CST);
+
+	return VK_TRUE;
+}
+
+/* Must be called with the mutex held. */
+static void
+cmap_free_retired(vk_cmap_t *map)
+{
+	vk_cmap_table_t *table = map->table->retired;
+
+	if (!table || __atomic_load_n(&map->readers, __ATOMIC_SEQ_CST) != 0)
+		return;
+
+	map->table->retired = NULL;
+
+	while (table) {
+		vk_cmap_table_t *retired = table->retired;
+
+		free(table);
+		table = retired;
+	}
+}
+
+/* Must be called with the mutex held. Linear probing deletion, Knuth's algorithm R. */
+static void
+cmap_remove(vk_cmap_t *map, uint32_t index)
+{
+	vk_cmap_table_t	*table = map->table;
+	uint32_t		 next = index;
+
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (;;) {
+		vk_cmap_slot_t	*slot;
+		uint32_t		 home;
+
+		next = (next + 1) & table->mask;
+		slot = &table->slots[next];
+
+		if (!slot->data)
+			break;
+
+		/* Move the entry back if its home slot is not in (index, next]. */
+		home = cmap_index(table, slot->key);
+		if (((next - home) & table->mask) < ((next - index) & table->mask))
+			continue;
+
+		__atomic_store_n(&table->slots[index].key, slot->key, __ATOMIC_RELAXED);
+		__atomic_store_n(&table->slots[index].data, slot->data, __ATOMIC_RELAXED);
+		index = next;
+	}
+
+	__atomic_store_n(&table->slots[index].data, NULL, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELEASE);
+}
+
+vk_cmap_t *
+vk_cmap_create(int bucket_bits)
+{
+	vk_cmap_t *map;
+
+	map = calloc(1, sizeof(vk_cmap_t));
+	VK_CHECK(map, return NULL, "calloc() failed.\n");
+
+	map->table = cmap_table_create(MAX(bucket_bits, 2));
+	VK_CHECK(map->table, goto error, "cmap_table_create() failed.\n");
+
+	pthread_mutex_init(&map->mutex, NULL);
+	return map;
+
+error:
+	free(map);
+	return NULL;
+}
+
+void
+vk_cmap_destroy(vk_cmap_t *map, vk_free_func_t free_func)
+{
+	vk_cmap_table_t	*table = map->table;
+	uint32_t		 i;
+
+	if (free_func) {
+		for (i = 0; i <= table->mask; i++) {
+			if (table->slots[i].data)
+				free_func(table->slots[i].data);
+		}
+	}
+
+	while (table) {
+		vk_cmap_table_t *retired = table->retired;
+
+		free(table);
+		table = retired;
+	}
+
+	pthread_mutex_destroy(&map->mutex);
+	free(map);
+}
+
+void *
+vk_cmap_get(vk_cmap_t *map, uint64_t key)
+{
+	void *result;
+
+	__atomic_add_fetch(&map->readers, 1, __ATOMIC_SEQ_CST);
+
+	for (;;) {
+		const vk_cmap_table_t	*table;
+		void					*data = NULL;
+		uint32_t				 seq, index, i;
+
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		table = __atomic_load_n(&map->table, __ATOMIC_SEQ_CST);
+		index = cmap_index(table, key);
+
+		/* Bounded, a torn table may be full of entries from the reader's point of view. */
+		for (i = 0; i <= table->mask; i++) {
+			const vk_cmap_slot_t	*slot = &table->slots[index];
+			void					*slot_data;
+
+			slot_data = __atomic_load_n(&slot->data, __ATOMIC_ACQUIRE);
+			if (!slot_data)
+				break;
+
+			if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key) {
+				data = slot_data;
+				break;
+			}
+
+			index = (index + 1) & table->mask;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+			result = data;
+			break;
+		}
+	}
+
+	__atomic_sub_fetch(&map->readers, 1, __ATOMIC_RELEASE);
+	return result;
+}
+
+vk_bool_t
+vk_cmap_set(vk_cmap_t *map, uint64_t key, void *data)
+{
+	vk_bool_t	result = VK_TRUE;
+	int64_t		index;
+
+	pthread_mutex_lock(&map->mutex);
+
+	index = cmap_find(map->table, key);
+
+	if (index >= 0) {
+		if (data) {
+			__atomic_store_n(&map->table->slots[index].data, data, __ATOMIC_RELEASE);
+		} else {
+			cmap_remove(map, index);
+			map->count--;
+		}
+	} else if (data) {
+		/* Keep the load factor under 3/4. */
+		if ((map->count + 1) * 4 > (map->table->mask + 1) * 3)
+			result = cmap_grow(map);
+
+		if (result) {
+			cmap_place(map->table, key, data);
+			map->count++;
+		}
+	}
+
+	cmap_free_retired(map);
+	pthread_mutex_unlock(&map->mutex);
+	return result;
+}
+
+void *
+vk_cmap_remove(vk_cmap_t *map, uint64_t key)
+{
+	void	*data = NULL;
+	int64_t	 index;
+
+	pthread_mutex_lock(&map->mutex);
+
+	index = cmap_find(map->table, key);
+	if (index >= 0) {
+		data = map->table->slots[index].data;
+		cmap_remove(map, index);
+		map->count--;
+	}
+
+	cmap_free_retired(map);
+	pthread_mutex_unlock(&map->mutex);
+	return data;
+}
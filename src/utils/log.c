@@ -25,22 +25,309 @@
 #include "utils.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
-#define VK_LOG_FILE	stdout
+#define VK_LOG_FILE			stdout
+#define VK_LOG_LINE_SIZE	1024
 
-void
-vk_log(const char *domain, const char *file, int line, const char *format, ...)
+/* Runtime threshold, -1 until read from the environment. */
+int vk_log_level = -1;
+
+static const char *level_names[] = {
+	[VK_LOG_LEVEL_NONE] = "NONE",
+	[VK_LOG_LEVEL_ERROR] = "ERROR",
+	[VK_LOG_LEVEL_WARN] = "WARN",
+	[VK_LOG_LEVEL_INFO] = "INFO",
+	[VK_LOG_LEVEL_DEBUG] = "DEBUG",
+};
+
+int
+vk_log_init_level(void)
+{
+	const char	*env = getenv("VK_TIZEN_LOG_LEVEL");
+	int			 level = VK_LOG_LEVEL_WARN;
+	int			 i;
+
+	if (env) {
+		if (env[0] >= '0' && env[0] <= '9')
+			level = atoi(env);
+
+		for (i = 0; i < (int)ARRAY_LENGTH(level_names); i++) {
+			if (strcasecmp(env, level_names[i]) == 0)
+				level = i;
+		}
+	}
+
+	level = MAX(level, VK_LOG_LEVEL_NONE);
+
+	/* Racing initialisations all compute the same value. */
+	__atomic_store_n(&vk_log_level, level, __ATOMIC_RELAXED);
+	return level;
+}
+
+/* Asynchronous backend, enabled with VK_TIZEN_LOG_ASYNC.
+ *
+ * Each logging thread owns a single-producer single-consumer byte ring holding length-prefixed
+ * lines. A background thread drains all rings into the log file. A producer never waits: when
+ * its ring is full the line is dropped and counted, and the drain thread reports the count. */
+#define LOG_RING_SIZE		(16 * 1024)
+#define LOG_DRAIN_INTERVAL	5000000	/* ns */
+
+typedef struct log_ring	log_ring_t;
+
+struct log_ring {
+	uint32_t	 head;		/* Written by the producer. */
+	uint32_t	 tail;		/* Written by the drain thread. */
+	uint32_t	 dropped;
+	vk_bool_t	 dead;		/* Owner thread exited, free once drained. */
+	log_ring_t	*next;
+	char		 data[LOG_RING_SIZE];
+};
+
+static pthread_once_t		 log_async_once = PTHREAD_ONCE_INIT;
+static vk_bool_t			 log_async;
+static pthread_key_t		 log_ring_key;
+static __thread log_ring_t	*log_thread_ring;
+
+static pthread_mutex_t		 log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t			*log_rings;
+static pthread_t			 log_drain_thread;
+static vk_bool_t			 log_drain_stop;
+static uint32_t				 log_writers;	/* Threads inside the async path of log_write(). */
+
+static void
+log_ring_copy_out(const log_ring_t *ring, uint32_t pos, void *dst, uint32_t size)
+{
+	uint32_t offset = pos & (LOG_RING_SIZE - 1);
+	uint32_t first = MIN(size, LOG_RING_SIZE - offset);
+
+	memcpy(dst, ring->data + offset, first);
+	memcpy((char *)dst + first, ring->data, size - first);
+}
+
+static void
+log_ring_copy_in(log_ring_t *ring, uint32_t pos, const void *src, uint32_t size)
+{
+	uint32_t offset = pos & (LOG_RING_SIZE - 1);
+	uint32_t first = MIN(size, LOG_RING_SIZE - offset);
+
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const char *)src + first, size - first);
+}
+
+/* Drains one ring, returns whether anything was written. */
+static vk_bool_t
+log_ring_drain(log_ring_t *ring)
+{
+	char		buf[VK_LOG_LINE_SIZE];
+	uint32_t	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t	tail = ring->tail;
+	uint32_t	dropped;
+	uint16_t	len;
+	vk_bool_t	written = VK_FALSE;
+
+	while (tail != head) {
+		log_ring_copy_out(ring, tail, &len, sizeof(len));
+		log_ring_copy_out(ring, tail + sizeof(len), buf, len);
+		fwrite(buf, 1, len, VK_LOG_FILE);
+
+		tail += sizeof(len) + len;
+		written = VK_TRUE;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		fprintf(VK_LOG_FILE, "[VK] WARN: %u log messages dropped\n", dropped);
+		written = VK_TRUE;
+	}
+
+	return written;
+}
+
+static void
+log_drain_all(void)
+{
+	log_ring_t	**link;
+	vk_bool_t	  written = VK_FALSE;
+
+	pthread_mutex_lock(&log_rings_mutex);
+
+	link = &log_rings;
+	while (*link) {
+		log_ring_t *ring = *link;
+
+		/* Check for death before draining, so that the last lines are not lost. */
+		vk_bool_t dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+		written |= log_ring_drain(ring);
+
+		if (dead) {
+			*link = ring->next;
+			free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	if (written)
+		fflush(VK_LOG_FILE);
+}
+
+static void *
+log_drain_main(void *data)
+{
+	struct timespec interval = { 0, LOG_DRAIN_INTERVAL };
+
+	while (!__atomic_load_n(&log_drain_stop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		log_drain_all();
+	}
+
+	return NULL;
+}
+
+static void
+log_ring_release(void *data)
+{
+	log_ring_t *ring = data;
+
+	__atomic_store_n(&ring->dead, VK_TRUE, __ATOMIC_RELEASE);
+}
+
+static void
+log_async_init(void)
+{
+	const char *env = getenv("VK_TIZEN_LOG_ASYNC");
+
+	if (!env || strcmp(env, "0") == 0)
+		return;
+
+	if (pthread_key_create(&log_ring_key, log_ring_release))
+		return;
+
+	if (pthread_create(&log_drain_thread, NULL, log_drain_main, NULL))
+		return;
+
+	log_async = VK_TRUE;
+}
+
+static void __attribute__((destructor))
+log_async_fini(void)
+{
+	if (!log_async)
+		return;
+
+	/* Later messages, e.g. from other destructors, are written synchronously. Threads already
+	 * writing to their ring are waited for before the rings go away. */
+	__atomic_store_n(&log_async, VK_FALSE, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&log_writers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&log_drain_stop, VK_TRUE, __ATOMIC_RELEASE);
+	pthread_join(log_drain_thread, NULL);
+
+	log_drain_all();
+
+	/* The key destructor must not outlive the module. */
+	pthread_key_delete(log_ring_key);
+
+	while (log_rings) {
+		log_ring_t *next = log_rings->next;
+
+		free(log_rings);
+		log_rings = next;
+	}
+}
+
+static log_ring_t *
+log_ring_get(void)
 {
-	va_list args;
+	log_ring_t *ring = log_thread_ring;
+
+	if (ring)
+		return ring;
+
+	/* First message of this thread. */
+	ring = calloc(1, sizeof(log_ring_t));
+	if (!ring)
+		return NULL;
+
+	pthread_setspecific(log_ring_key, ring);
+
+	pthread_mutex_lock(&log_rings_mutex);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	log_thread_ring = ring;
+	return ring;
+}
+
+static void
+log_write(const char *buf, int len)
+{
+	log_ring_t	*ring;
+	uint16_t	 size = len;
+	uint32_t	 head, tail;
+
+	pthread_once(&log_async_once, log_async_init);
+
+	/* Announce the write before checking the backend, log_async_fini() does the reverse. */
+	__atomic_add_fetch(&log_writers, 1, __ATOMIC_SEQ_CST);
 
-	fprintf(VK_LOG_FILE, "[VK] ");
+	if (!__atomic_load_n(&log_async, __ATOMIC_SEQ_CST) || !(ring = log_ring_get())) {
+		__atomic_sub_fetch(&log_writers, 1, __ATOMIC_RELEASE);
+		fwrite(buf, 1, len, VK_LOG_FILE);
+		return;
+	}
 
-	if (domain)
-		fprintf(VK_LOG_FILE, "%s: ", domain);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (LOG_RING_SIZE - (head - tail) < sizeof(size) + size) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		log_ring_copy_in(ring, head, &size, sizeof(size));
+		log_ring_copy_in(ring, head + sizeof(size), buf, size);
+
+		__atomic_store_n(&ring->head, head + sizeof(size) + size, __ATOMIC_RELEASE);
+	}
+
+	__atomic_sub_fetch(&log_writers, 1, __ATOMIC_RELEASE);
+}
+
+void
+vk_log(int level, const char *file, int line, const char *format, ...)
+{
+	char	buf[VK_LOG_LINE_SIZE];
+	va_list	args;
+	int		len, n;
+
+	len = snprintf(buf, sizeof(buf), "[VK] %s: ",
+				   level > 0 && level < (int)ARRAY_LENGTH(level_names) ? level_names[level] : "LOG");
 
 	va_start(args, format);
-	vfprintf(VK_LOG_FILE, format, args);
+	n = vsnprintf(buf + len, sizeof(buf) - len, format, args);
 	va_end(args);
 
-	fprintf(VK_LOG_FILE, " %s:%d\n", file, line);
+	len = MIN(len + MAX(n, 0), (int)sizeof(buf) - 1);
+
+	/* Messages often end with a newline, keep the location on the same line. */
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+
+	n = snprintf(buf + len, sizeof(buf) - len, " %s:%d\n", file, line);
+	len = MIN(len + MAX(n, 0), (int)sizeof(buf) - 1);
+
+	/* A single write keeps lines from concurrent threads from interleaving. */
+	log_write(buf, len);
 }
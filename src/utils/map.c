@@ -26,78 +26,26 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct vk_map_entry
-{
-	const void		*key;
-	void			*data;
-	vk_free_func_t	 free_func;
-	vk_map_entry_t	*next;
-};
-
-static inline int
-get_bucket_index(vk_map_t *map, const void *key)
-{
-	int	len = 0;
-	int	hash;
-
-	if (map->key_length_func)
-		len = map->key_length_func(key);
-
-	hash = map->hash_func(key, len);
-	return hash & map->bucket_mask;
-}
-
-static inline vk_map_entry_t **
-get_bucket(vk_map_t *map, const void *key)
-{
-	return &map->buckets[get_bucket_index(map, key)];
-}
-
-void
-vk_map_init(vk_map_t				*map,
-			int						 bucket_bits,
-			vk_hash_func_t			 hash_func,
-			vk_key_length_func_t	 key_length_func,
-			vk_key_compare_func_t	 key_compare_func,
-			void					*buckets)
-{
-	map->hash_func = hash_func;
-	map->key_length_func = key_length_func;
-	map->key_compare_func = key_compare_func;
-
-	map->bucket_bits = bucket_bits;
-	map->bucket_size = 1 << bucket_bits;
-	map->bucket_mask = map->bucket_size - 1;
-
-	map->buckets = buckets;
-}
-
-/* Hash functions from Thomas Wang https://gist.github.com/badboy/6267743 */
-static inline int
-vk_hash32(uint32_t key)
-{
-    key  = ~key + (key << 15);
-    key ^= key >> 12;
-    key += key << 2;
-    key ^= key >> 4;
-    key *= 2057;
-    key ^= key >> 16;
+/* Open addressing hash table with Robin Hood probing.
+ *
+ * Entries live in a single power of two sized array. Each entry caches the hash and the length
+ * of its key, so that probing rarely needs to call the key functions. A hash of 0 marks an
+ * empty slot. An entry is never further from its home slot than the entry it displaced, which
+ * lets a lookup stop as soon as it meets a "richer" entry, and lets deletion shift the following
+ * entries back instead of leaving tombstones. The table doubles when it gets 3/4 full.
+ *
+ * Keys up to 8 bytes are copied inline into the entry, longer ones are copied to the heap. Maps
+ * created with the int32/int64 variants bypass the function pointers altogether. */
 
-    return key;
-}
+#define MAP_MIN_BUCKET_BITS		2
 
-static inline int
-vk_hash64(uint64_t key)
-{
-    key  = ~key + (key << 18);
-    key ^= key >> 31;
-    key *= 21;
-    key ^= key >> 11;
-    key += key << 6;
-    key ^= key >> 22;
+#define MAP_KEY_INLINE_SIZE		sizeof(uint64_t)
 
-    return (int)key;
-}
+enum {
+	MAP_TYPE_GENERIC,
+	MAP_TYPE_INT32,
+	MAP_TYPE_INT64,
+};
 
 static int
 int32_hash(const void *key, int len)
@@ -119,12 +67,6 @@ int32_key_compare(const void *key0, int len0, const void *key1, int len1)
 	return (int)(k0 - k1);
 }
 
-void
-vk_map_int32_init(vk_map_t *map, int bucket_bits, void *buckets)
-{
-	vk_map_init(map, bucket_bits, int32_hash, int32_key_length, int32_key_compare, buckets);
-}
-
 static int
 int64_hash(const void *key, int len)
 {
@@ -145,12 +87,6 @@ int64_key_compare(const void *key0, int len0, const void *key1, int len1)
 	return (int)(k0 - k1);
 }
 
-void
-vk_map_int64_init(vk_map_t *map, int bucket_bits, void *buckets)
-{
-	vk_map_init(map, bucket_bits, int64_hash, int64_key_length, int64_key_compare, buckets);
-}
-
 /* String hash function taken from Eina library.
    Paul Hsieh (http://www.azillionmonkeys.com/qed/hash.html)
    used by WebCore (http://webkit.org/blog/8/hashtables-part-2/) */
@@ -164,8 +100,8 @@ vk_map_int64_init(vk_map_t *map, int bucket_bits, void *buckets)
 					   + (uint32_t)(((const uint8_t *)(d))[0]))
 #endif
 
-static int
-string_hash(const void *key, int len)
+int
+vk_hash_string_hsieh(const void *key, int len)
 {
 	int hash = len, tmp;
 	int rem;
@@ -215,6 +151,130 @@ string_hash(const void *key, int len)
 	return hash;
 }
 
+/* Word-at-a-time string hash after wyhash by Wang Yi (public domain,
+   https://github.com/wangyi-fudan/wyhash). Keys are consumed 8 or 16 bytes at a time and mixed
+   with 64x64->128 bit multiplications. */
+static const uint64_t wy_secret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static inline void
+wy_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)*a * *b;
+
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), lo;
+	uint64_t c = t < rl;
+
+	lo = t + (rm1 << 32);
+	c += lo < t;
+
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t
+wy_mix(uint64_t a, uint64_t b)
+{
+	wy_mum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+wy_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wy_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+int
+vk_hash_string_wy(const void *key, int len)
+{
+	const uint8_t	*p = key;
+	uint64_t		 seed = wy_mix(wy_secret[0], wy_secret[1]);
+	uint64_t		 a, b;
+	size_t			 i = len > 0 ? (size_t)len : 0;
+
+	if (i <= 16) {
+		if (i >= 4) {
+			size_t mid = (i >> 3) << 2;
+
+			a = (wy_read32(p) << 32) | wy_read32(p + mid);
+			b = (wy_read32(p + i - 4) << 32) | wy_read32(p + i - 4 - mid);
+		} else if (i > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[i >> 1] << 8) | p[i - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+
+			do {
+				seed = wy_mix(wy_read64(p) ^ wy_secret[1], wy_read64(p + 8) ^ seed);
+				see1 = wy_mix(wy_read64(p + 16) ^ wy_secret[2], wy_read64(p + 24) ^ see1);
+				see2 = wy_mix(wy_read64(p + 32) ^ wy_secret[3], wy_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+
+			seed ^= see1 ^ see2;
+		}
+
+		while (i > 16) {
+			seed = wy_mix(wy_read64(p) ^ wy_secret[1], wy_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		a = wy_read64(p + i - 16);
+		b = wy_read64(p + i - 8);
+	}
+
+	a ^= wy_secret[1];
+	b ^= seed;
+	wy_mum(&a, &b);
+
+	a = wy_mix(a ^ wy_secret[0] ^ (uint64_t)len, b ^ wy_secret[1]);
+	return (int)(uint32_t)(a ^ (a >> 32));
+}
+
+vk_hash_func_t
+vk_hash_string_func(vk_hash_family_t family)
+{
+	switch (family) {
+	case VK_HASH_FAMILY_HSIEH:
+		return vk_hash_string_hsieh;
+	default:
+		return vk_hash_string_wy;
+	}
+}
+
+int
+vk_hash_string(const void *key, int len)
+{
+	return vk_hash_string_wy(key, len);
+}
+
 static int
 string_key_length(const void *key)
 {
@@ -235,16 +295,263 @@ string_key_compare(const void *key0, int len0, const void *key1, int len1)
 	return strcmp(key0, key1);
 }
 
+static inline const void *
+map_entry_key(const vk_map_entry_t *entry)
+{
+	if (entry->key_length > 0 && entry->key_length <= (int)MAP_KEY_INLINE_SIZE)
+		return &entry->inline_key;
+
+	return entry->key;
+}
+
+static inline uint32_t
+map_hash(const vk_map_t *map, const void *key, int *len)
+{
+	uint32_t hash;
+
+	switch (map->type) {
+	case MAP_TYPE_INT32:
+		*len = 4;
+		hash = vk_hash32(*(const uint32_t *)key);
+		break;
+	case MAP_TYPE_INT64:
+		*len = 8;
+		hash = vk_hash64(*(const uint64_t *)key);
+		break;
+	default:
+		*len = map->key_length_func ? map->key_length_func(key) : 0;
+		hash = map->hash_func(key, *len);
+		break;
+	}
+
+	/* 0 is reserved for empty slots. */
+	return hash ? hash : 1;
+}
+
+static inline vk_bool_t
+map_entry_match(const vk_map_t *map, const vk_map_entry_t *entry,
+				const void *key, int len, uint32_t hash)
+{
+	if (entry->hash != hash)
+		return VK_FALSE;
+
+	switch (map->type) {
+	case MAP_TYPE_INT32:
+		return (uint32_t)entry->inline_key == *(const uint32_t *)key;
+	case MAP_TYPE_INT64:
+		return entry->inline_key == *(const uint64_t *)key;
+	default:
+		return entry->key_length == len &&
+			   map->key_compare_func(map_entry_key(entry), len, key, len) == 0;
+	}
+}
+
+static inline int
+map_probe_distance(const vk_map_t *map, int index, uint32_t hash)
+{
+	return (index - (int)(hash & map->bucket_mask)) & map->bucket_mask;
+}
+
+static int
+map_find(const vk_map_t *map, const void *key, int len, uint32_t hash)
+{
+	int index = hash & map->bucket_mask;
+	int dist;
+
+	for (dist = 0; dist < map->bucket_size; dist++) {
+		const vk_map_entry_t *entry = &map->entries[index];
+
+		if (entry->hash == 0 || map_probe_distance(map, index, entry->hash) < dist)
+			return -1;
+
+		if (map_entry_match(map, entry, key, len, hash))
+			return index;
+
+		index = (index + 1) & map->bucket_mask;
+	}
+
+	return -1;
+}
+
+/* Places an entry whose key is known to be absent. */
+static void
+map_place(vk_map_t *map, vk_map_entry_t *entry)
+{
+	vk_map_entry_t	tmp;
+	int				index = entry->hash & map->bucket_mask;
+	int				dist = 0;
+
+	for (;;) {
+		vk_map_entry_t	*curr = &map->entries[index];
+		int				 curr_dist;
+
+		if (curr->hash == 0) {
+			*curr = *entry;
+			map->entry_count++;
+			return;
+		}
+
+		/* Take the slot from an entry closer to its home, and carry on placing that one. */
+		curr_dist = map_probe_distance(map, index, curr->hash);
+		if (curr_dist < dist) {
+			tmp = *curr;
+			*curr = *entry;
+			*entry = tmp;
+			dist = curr_dist;
+		}
+
+		index = (index + 1) & map->bucket_mask;
+		dist++;
+	}
+}
+
+static void
+map_entry_fini(vk_map_entry_t *entry)
+{
+	if (entry->free_func)
+		entry->free_func(entry->data);
+
+	if (entry->key_length > (int)MAP_KEY_INLINE_SIZE)
+		free((void *)entry->key);
+}
+
+static void
+map_remove(vk_map_t *map, int index)
+{
+	int next = (index + 1) & map->bucket_mask;
+
+	/* Shift following entries back by one until one sits in its home slot. */
+	while (map->entries[next].hash &&
+		   map_probe_distance(map, next, map->entries[next].hash) > 0) {
+		map->entries[index] = map->entries[next];
+		index = next;
+		next = (next + 1) & map->bucket_mask;
+	}
+
+	memset(&map->entries[index], 0x00, sizeof(vk_map_entry_t));
+	map->entry_count--;
+}
+
+static void
+map_set_size(vk_map_t *map, int bucket_bits, vk_map_entry_t *entries)
+{
+	map->bucket_bits = bucket_bits;
+	map->bucket_size = 1 << bucket_bits;
+	map->bucket_mask = map->bucket_size - 1;
+	map->entries = entries;
+}
+
+static vk_bool_t
+map_grow(vk_map_t *map)
+{
+	vk_map_entry_t	*old_entries = map->entries;
+	int				 old_size = map->bucket_size;
+	vk_map_entry_t	*entries;
+	int				 i;
+
+	entries = calloc((size_t)old_size * 2, sizeof(vk_map_entry_t));
+	VK_CHECK(entries, return VK_FALSE, "calloc() failed.\n");
+
+	map_set_size(map, map->bucket_bits + 1, entries);
+	map->entry_count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_entries[i].hash)
+			map_place(map, &old_entries[i]);
+	}
+
+	if (old_entries != map->buckets)
+		free(old_entries);
+
+	return VK_TRUE;
+}
+
+static void
+map_init(vk_map_t				*map,
+		 int					 type,
+		 int					 bucket_bits,
+		 vk_hash_func_t			 hash_func,
+		 vk_key_length_func_t	 key_length_func,
+		 vk_key_compare_func_t	 key_compare_func,
+		 void					*buckets)
+{
+	map->hash_func = hash_func;
+	map->key_length_func = key_length_func;
+	map->key_compare_func = key_compare_func;
+	map->type = type;
+	map->entry_count = 0;
+
+	/* Initial entries are provided by the caller; larger tables are allocated on demand. */
+	map->buckets = buckets;
+
+	if (buckets)
+		memset(buckets, 0x00, sizeof(vk_map_entry_t) << bucket_bits);
+	else
+		buckets = calloc((size_t)1 << bucket_bits, sizeof(vk_map_entry_t));
+
+	map_set_size(map, bucket_bits, buckets);
+}
+
+void
+vk_map_init(vk_map_t				*map,
+			int						 bucket_bits,
+			vk_hash_func_t			 hash_func,
+			vk_key_length_func_t	 key_length_func,
+			vk_key_compare_func_t	 key_compare_func,
+			void					*buckets)
+{
+	map_init(map, MAP_TYPE_GENERIC, bucket_bits,
+			 hash_func, key_length_func, key_compare_func, buckets);
+}
+
+void
+vk_map_int32_init(vk_map_t *map, int bucket_bits, void *buckets)
+{
+	map_init(map, MAP_TYPE_INT32, bucket_bits,
+			 int32_hash, int32_key_length, int32_key_compare, buckets);
+}
+
+void
+vk_map_int64_init(vk_map_t *map, int bucket_bits, void *buckets)
+{
+	map_init(map, MAP_TYPE_INT64, bucket_bits,
+			 int64_hash, int64_key_length, int64_key_compare, buckets);
+}
+
 void
 vk_map_string_init(vk_map_t *map, int bucket_bits, void *buckets)
 {
-	vk_map_init(map, bucket_bits, string_hash, string_key_length, string_key_compare, buckets);
+	map_init(map, MAP_TYPE_GENERIC, bucket_bits,
+			 vk_hash_string_wy, string_key_length, string_key_compare, buckets);
 }
 
 void
 vk_map_fini(vk_map_t *map)
 {
 	vk_map_clear(map);
+
+	if (map->entries != map->buckets)
+		free(map->entries);
+
+	map->entries = NULL;
+}
+
+static vk_map_t *
+map_create(int						type,
+		   int						bucket_bits,
+		   vk_hash_func_t			hash_func,
+		   vk_key_length_func_t		key_length_func,
+		   vk_key_compare_func_t	key_compare_func)
+{
+	vk_map_t *map;
+
+	bucket_bits = MAX(bucket_bits, MAP_MIN_BUCKET_BITS);
+
+	map = calloc(1, sizeof(vk_map_t) + (sizeof(vk_map_entry_t) << bucket_bits));
+	VK_CHECK(map, return NULL, "calloc() failed.\n");
+
+	map_init(map, type, bucket_bits, hash_func, key_length_func, key_compare_func, map + 1);
+	return map;
 }
 
 vk_map_t *
@@ -253,32 +560,34 @@ vk_map_create(int					bucket_bits,
 			  vk_key_length_func_t	key_length_func,
 			  vk_key_compare_func_t	key_compare_func)
 {
-	vk_map_t	*map;
-	int			 bucket_size = 1 << bucket_bits;
-
-	map = calloc(1, sizeof(vk_map_t) + bucket_size * sizeof(vk_map_entry_t *));
-	VK_CHECK(map, return NULL, "calloc() failed.\n");
-
-	vk_map_init(map, bucket_bits, hash_func, key_length_func, key_compare_func, map + 1);
-	return map;
+	return map_create(MAP_TYPE_GENERIC, bucket_bits, hash_func, key_length_func, key_compare_func);
 }
 
 vk_map_t *
 vk_map_int32_create(int bucket_bits)
 {
-	return vk_map_create(bucket_bits, int32_hash, int32_key_length, int32_key_compare);
+	return map_create(MAP_TYPE_INT32, bucket_bits,
+					  int32_hash, int32_key_length, int32_key_compare);
 }
 
 vk_map_t *
 vk_map_int64_create(int bucket_bits)
 {
-	return vk_map_create(bucket_bits, int64_hash, int64_key_length, int64_key_compare);
+	return map_create(MAP_TYPE_INT64, bucket_bits,
+					  int64_hash, int64_key_length, int64_key_compare);
 }
 
 vk_map_t *
 vk_map_string_create(int bucket_bits)
 {
-	return vk_map_create(bucket_bits, string_hash, string_key_length, string_key_compare);
+	return vk_map_string_create_with_hash(bucket_bits, VK_HASH_FAMILY_DEFAULT);
+}
+
+vk_map_t *
+vk_map_string_create_with_hash(int bucket_bits, vk_hash_family_t family)
+{
+	return map_create(MAP_TYPE_GENERIC, bucket_bits,
+					  vk_hash_string_func(family), string_key_length, string_key_compare);
 }
 
 void
@@ -293,121 +602,80 @@ vk_map_clear(vk_map_t *map)
 {
 	int i;
 
-	if (!map->buckets)
+	if (!map->entries)
 		return;
 
-	for (i = 0; i < map->bucket_size; i++)
-	{
-		vk_map_entry_t *curr = map->buckets[i];
-
-		while (curr)
-		{
-			vk_map_entry_t *next = curr->next;
-
-			if (curr->free_func)
-				curr->free_func(curr->data);
-
-			free(curr);
-			curr = next;
-		}
+	for (i = 0; i < map->bucket_size; i++) {
+		if (map->entries[i].hash)
+			map_entry_fini(&map->entries[i]);
 	}
 
-	memset(map->buckets, 0x00, map->bucket_size * sizeof(vk_map_entry_t *));
+	memset(map->entries, 0x00, map->bucket_size * sizeof(vk_map_entry_t));
+	map->entry_count = 0;
 }
 
 void *
 vk_map_get(vk_map_t *map, const void *key)
 {
-	vk_map_entry_t	*curr = *get_bucket(map, key);
-	int				 len0 = 0;
-	int				 len1 = 0;
-
-	if (map->key_length_func)
-		len1 = map->key_length_func(key);
-
-	while (curr)
-	{
-		if (map->key_length_func)
-			len0 = map->key_length_func(curr->key);
-
-		if (map->key_compare_func(curr->key, len0, key, len1) == 0)
-			return curr->data;
-
-		curr = curr->next;
-	}
+	int			len;
+	uint32_t	hash = map_hash(map, key, &len);
+	int			index = map_find(map, key, len, hash);
 
-	return NULL;
+	return index < 0 ? NULL : map->entries[index].data;
 }
 
 void
 vk_map_set(vk_map_t *map, const void *key, void *data, vk_free_func_t free_func)
 {
-	vk_map_entry_t	**bucket = get_bucket(map, key);
-	vk_map_entry_t	 *curr = *bucket;
-	vk_map_entry_t	 *prev = NULL;
-	int 			  len0 = 0;
-	int 			  len1 = 0;
-
-	if (map->key_length_func)
-		len1 = map->key_length_func(key);
-
-	/* Find existing entry for the key. */
-	while (curr)
-	{
-		if (map->key_length_func)
-			len0 = map->key_length_func(curr->key);
-
-		if (map->key_compare_func(curr->key, len0, key, len1) == 0)
-		{
-			/* Free previous data. */
-			if (curr->free_func)
-				curr->free_func(curr->data);
-
-			if (data)
-			{
-				/* Set new data. */
-				curr->data = data;
-				curr->free_func = free_func;
-			}
-			else
-			{
-				/* Delete entry. */
-				if (prev)
-					prev->next = curr->next;
-				else
-					*bucket = curr->next;
-
-				free(curr);
-			}
-
-			return;
+	vk_map_entry_t	 entry;
+	int				 len;
+	uint32_t		 hash = map_hash(map, key, &len);
+	int				 index = map_find(map, key, len, hash);
+
+	if (index >= 0) {
+		vk_map_entry_t *curr = &map->entries[index];
+
+		/* Free previous data. */
+		if (curr->free_func)
+			curr->free_func(curr->data);
+
+		if (data) {
+			/* Set new data. */
+			curr->data = data;
+			curr->free_func = free_func;
+		} else {
+			/* Delete entry. */
+			curr->free_func = NULL;
+			map_entry_fini(curr);
+			map_remove(map, index);
 		}
 
-		prev = curr;
-		curr = curr->next;
+		return;
 	}
 
-	if (data == NULL)
-	{
+	if (data == NULL) {
 		/* Nothing to delete. */
 		return;
 	}
 
-	/* Allocate a new entry. */
-	curr = malloc(sizeof(vk_map_entry_t) + len1);
-	VK_CHECK(curr, return, "malloc() failed.\n");
+	if ((map->entry_count + 1) * 4 > map->bucket_size * 3 && !map_grow(map))
+		return;
+
+	memset(&entry, 0x00, sizeof(vk_map_entry_t));
+	entry.hash = hash;
+	entry.key_length = len;
+	entry.data = data;
+	entry.free_func = free_func;
 
-	if (len1) {
-		curr->key = curr + 1;
-		memcpy((void *)curr->key, key, len1);
+	if (len == 0) {
+		entry.key = key;
+	} else if (len <= (int)MAP_KEY_INLINE_SIZE) {
+		memcpy(&entry.inline_key, key, len);
 	} else {
-		curr->key = key;
+		entry.key = malloc(len);
+		VK_CHECK(entry.key, return, "malloc() failed.\n");
+		memcpy((void *)entry.key, key, len);
 	}
 
-	curr->data = data;
-	curr->free_func = free_func;
-
-	/* Insert at the head of the bucket. */
-	curr->next = *bucket;
-	*bucket = curr;
+	map_place(map, &entry);
 }
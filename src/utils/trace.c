@@ -0,0 +1,162 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+/* Event tracing in the Chrome trace event format, loadable by chrome://tracing and Perfetto.
+ *
+ * Enabled by setting VK_TIZEN_TRACE to the path of the JSON file to write. Events go to a
+ * global ring of VK_TIZEN_TRACE_EVENTS entries (65536 by default) claimed with an atomic
+ * increment, so recording never blocks. Once the ring wraps the oldest events are overwritten,
+ * keeping the latest part of the timeline. The file is written when the module is unloaded. */
+#define TRACE_DEFAULT_EVENTS	(1 << 16)
+
+typedef struct trace_event	trace_event_t;
+
+struct trace_event {
+	const char	*name;
+	uint64_t	 ts;
+	uint32_t	 tid;
+	char		 phase;
+};
+
+int vk_trace_state = -1;
+
+static const char		*trace_path;
+static trace_event_t	*trace_events;
+static uint32_t			 trace_mask;
+static uint64_t			 trace_count;
+static __thread uint32_t trace_tid;
+
+int
+vk_trace_init(void)
+{
+	static pthread_mutex_t	mutex = PTHREAD_MUTEX_INITIALIZER;
+	const char				*env;
+	uint32_t				 size = TRACE_DEFAULT_EVENTS;
+	int						 state;
+
+	pthread_mutex_lock(&mutex);
+
+	state = vk_trace_state;
+	if (state >= 0)
+		goto done;
+
+	state = 0;
+
+	trace_path = getenv("VK_TIZEN_TRACE");
+	if (!trace_path || !trace_path[0])
+		goto done;
+
+	env = getenv("VK_TIZEN_TRACE_EVENTS");
+	if (env && atoi(env) > 0) {
+		/* Round up to a power of two. */
+		while (size < (uint32_t)atoi(env) && size < (1u << 30))
+			size <<= 1;
+		while (size / 2 >= (uint32_t)atoi(env))
+			size >>= 1;
+	}
+
+	trace_events = calloc(size, sizeof(trace_event_t));
+	VK_CHECK(trace_events, goto done, "calloc() failed.\n");
+
+	trace_mask = size - 1;
+	state = 1;
+
+done:
+	__atomic_store_n(&vk_trace_state, state, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mutex);
+	return state;
+}
+
+void
+vk_trace_event(const char *name, char phase)
+{
+	struct timespec	 ts;
+	trace_event_t	*event;
+	uint64_t		 index;
+
+	if (!trace_tid)
+		trace_tid = (uint32_t)syscall(SYS_gettid);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	index = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+	event = &trace_events[index & trace_mask];
+
+	/* The name is published last, an event caught half written at dump time is skipped. */
+	__atomic_store_n(&event->name, NULL, __ATOMIC_RELAXED);
+	event->ts = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	event->tid = trace_tid;
+	event->phase = phase;
+	__atomic_store_n(&event->name, name, __ATOMIC_RELEASE);
+}
+
+static void __attribute__((destructor))
+trace_fini(void)
+{
+	uint64_t	 count, first, i;
+	FILE		*file;
+	const char	*sep = "";
+	int			 pid = getpid();
+
+	if (vk_trace_state != 1)
+		return;
+
+	/* Stop recording, late events from other threads are dropped. trace_events is never freed:
+	 * a thread that saw tracing enabled just before may still be writing its event. */
+	__atomic_store_n(&vk_trace_state, 0, __ATOMIC_RELEASE);
+
+	file = fopen(trace_path, "w");
+	VK_CHECK(file, return, "fopen(%s) failed.\n", trace_path);
+
+	count = __atomic_load_n(&trace_count, __ATOMIC_ACQUIRE);
+	first = count > trace_mask + 1 ? count - (trace_mask + 1) : 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	for (i = first; i < count; i++) {
+		const trace_event_t	*event = &trace_events[i & trace_mask];
+		const char			*name = __atomic_load_n(&event->name, __ATOMIC_ACQUIRE);
+
+		if (!name)
+			continue;
+
+		fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"wsi\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+				"\"pid\":%d,\"tid\":%u%s}", sep, name, event->phase,
+				(unsigned long long)(event->ts / 1000), (unsigned long long)(event->ts % 1000),
+				pid, event->tid, event->phase == 'i' ? ",\"s\":\"t\"" : "");
+		sep = ",";
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
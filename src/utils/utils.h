@@ -47,16 +47,32 @@
 #define ARRAY_LENGTH(a)	(sizeof(a) / sizeof((a)[0]))
 #endif
 
-#define VK_ERROR(fmt, ...)											\
-	do {															\
-		vk_log("ERROR", __FILE__, __LINE__, fmt, ##__VA_ARGS__);	\
-	} while (0)
+/* Log levels. Messages above VK_LOG_LEVEL_MAX are compiled out, see --with-log-level. Others
+ * are filtered at runtime against VK_TIZEN_LOG_LEVEL, which defaults to warnings. */
+#define VK_LOG_LEVEL_NONE	0
+#define VK_LOG_LEVEL_ERROR	1
+#define VK_LOG_LEVEL_WARN	2
+#define VK_LOG_LEVEL_INFO	3
+#define VK_LOG_LEVEL_DEBUG	4
+
+#ifndef VK_LOG_LEVEL_MAX
+#define VK_LOG_LEVEL_MAX	VK_LOG_LEVEL_DEBUG
+#endif
 
-#define VK_DEBUG(fmt, ...)											\
+#define VK_LOG_ENABLED(level)										\
+	((level) <= VK_LOG_LEVEL_MAX && (level) <= vk_log_get_level())
+
+#define VK_LOG(level, fmt, ...)										\
 	do {															\
-		vk_log("DEBUG", __FILE__, __LINE__, fmt, ##__VA_ARGS__);	\
+		if (VK_LOG_ENABLED(level))									\
+			vk_log(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__);	\
 	} while (0)
 
+#define VK_ERROR(fmt, ...)	VK_LOG(VK_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define VK_WARN(fmt, ...)	VK_LOG(VK_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define VK_INFO(fmt, ...)	VK_LOG(VK_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define VK_DEBUG(fmt, ...)	VK_LOG(VK_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
 #define VK_CHECK(exp, action, fmt, ...)								\
 	do {															\
 		if (!(exp))													\
@@ -68,13 +84,60 @@
 
 #define VK_ASSERT(exp)	assert(exp)
 
+/* Timeline tracing, see trace.c. Names must be string literals. */
+#define VK_TRACE_EVENT(name, phase)									\
+	do {															\
+		if (vk_trace_enabled())										\
+			vk_trace_event(name, phase);							\
+	} while (0)
+
+#define VK_TRACE_BEGIN(name)	VK_TRACE_EVENT(name, 'B')
+#define VK_TRACE_END(name)		VK_TRACE_EVENT(name, 'E')
+#define VK_TRACE_INSTANT(name)	VK_TRACE_EVENT(name, 'i')
+
 #define vk_container_of(ptr, sample, member)									\
 	(__typeof__(sample))((char *)(ptr) - offsetof(__typeof__(*sample), member))
 
 typedef VkBool32	vk_bool_t;
 
+extern int vk_log_level;
+
+int
+vk_log_init_level(void);
+
+static inline int
+vk_log_get_level(void)
+{
+	int level = __atomic_load_n(&vk_log_level, __ATOMIC_RELAXED);
+
+	if (__builtin_expect(level < 0, 0))
+		level = vk_log_init_level();
+
+	return level;
+}
+
 void
-vk_log(const char *domain, const char *file, int line, const char *format, ...);
+vk_log(int level, const char *file, int line, const char *format, ...)
+	__attribute__((format(printf, 4, 5)));
+
+extern int vk_trace_state;
+
+int
+vk_trace_init(void);
+
+static inline vk_bool_t
+vk_trace_enabled(void)
+{
+	int state = __atomic_load_n(&vk_trace_state, __ATOMIC_ACQUIRE);
+
+	if (__builtin_expect(state < 0, 0))
+		state = vk_trace_init();
+
+	return state > 0;
+}
+
+void
+vk_trace_event(const char *name, char phase);
 
 /* Linked list. */
 typedef struct vk_list vk_list_t;
@@ -174,27 +237,93 @@ vk_list_insert_list(vk_list_t *list, vk_list_t *other)
 	list->next = other->next;
 }
 
+/* Hash functions from Thomas Wang https://gist.github.com/badboy/6267743 */
+static inline int
+vk_hash32(uint32_t key)
+{
+    key  = ~key + (key << 15);
+    key ^= key >> 12;
+    key += key << 2;
+    key ^= key >> 4;
+    key *= 2057;
+    key ^= key >> 16;
+
+    return key;
+}
+
+static inline int
+vk_hash64(uint64_t key)
+{
+    key  = ~key + (key << 18);
+    key ^= key >> 31;
+    key *= 21;
+    key ^= key >> 11;
+    key += key << 6;
+    key ^= key >> 22;
+
+    return (int)key;
+}
+
 /* Hash table. */
 typedef struct vk_map		vk_map_t;
 typedef struct vk_map_entry	vk_map_entry_t;
 
 typedef void (*vk_free_func_t)(void *);
 typedef int  (*vk_hash_func_t)(const void *key, int key_length);
+
+/* String hash functions. WY is a word-at-a-time hash after wyhash and the default one, HSIEH
+ * is Paul Hsieh's SuperFastHash as used by Eina. */
+typedef enum vk_hash_family	vk_hash_family_t;
+
+enum vk_hash_family {
+	VK_HASH_FAMILY_DEFAULT,
+	VK_HASH_FAMILY_WY,
+	VK_HASH_FAMILY_HSIEH,
+};
+
+int
+vk_hash_string_wy(const void *key, int len);
+
+int
+vk_hash_string_hsieh(const void *key, int len);
+
+/* Hashes with the default family. */
+int
+vk_hash_string(const void *key, int len);
+
+vk_hash_func_t
+vk_hash_string_func(vk_hash_family_t family);
 typedef int  (*vk_key_length_func_t)(const void *key);
 typedef int  (*vk_key_compare_func_t)(const void *key0, int len0, const void *key1, int len1);
 
+struct vk_map_entry
+{
+	uint32_t			 hash;
+	int					 key_length;
+	const void			*key;
+	uint64_t			 inline_key;
+	void				*data;
+	vk_free_func_t		 free_func;
+};
+
 struct vk_map
 {
 	vk_hash_func_t			  hash_func;
 	vk_key_length_func_t	  key_length_func;
 	vk_key_compare_func_t	  key_compare_func;
+	int						  type;
 
 	int						  bucket_bits;
 	int						  bucket_size;
 	int						  bucket_mask;
-	vk_map_entry_t			**buckets;
+	int						  entry_count;
+	vk_map_entry_t			 *entries;
+
+	/* Initial entries given at init, used until the map grows. */
+	vk_map_entry_t			 *buckets;
 };
 
+/* The map starts with the (1 << bucket_bits) entries pointed by buckets and grows on demand. */
 void
 vk_map_init(vk_map_t				*map,
 			int						 bucket_bits,
@@ -230,6 +359,9 @@ vk_map_int64_create(int bucket_bits);
 vk_map_t *
 vk_map_string_create(int bucket_bits);
 
+vk_map_t *
+vk_map_string_create_with_hash(int bucket_bits, vk_hash_family_t family);
+
 void
 vk_map_destroy(vk_map_t *map);
 
@@ -242,4 +374,58 @@ vk_map_get(vk_map_t *map, const void *key);
 void
 vk_map_set(vk_map_t *map, const void *key, void *data, vk_free_func_t free_func);
 
+/* Concurrent hash table for 64-bit integer keys. Lookups are lock-free and may run concurrently
+ * with writers, which are serialised internally. Data must not be NULL, setting NULL removes the
+ * key. Readers racing with a writer may still get data being replaced or removed, so freeing it
+ * must be deferred until no such lookup can be running. The map must not be in use when
+ * destroyed. Used for the registries of dispatchable handles. */
+typedef struct vk_cmap		vk_cmap_t;
+
+vk_cmap_t *
+vk_cmap_create(int bucket_bits);
+
+void
+vk_cmap_destroy(vk_cmap_t *map, vk_free_func_t free_func);
+
+void *
+vk_cmap_get(vk_cmap_t *map, uint64_t key);
+
+vk_bool_t
+vk_cmap_set(vk_cmap_t *map, uint64_t key, void *data);
+
+void *
+vk_cmap_remove(vk_cmap_t *map, uint64_t key);
+
+/* Work items run by a pool of threads shared by the module. The caller owns the items and must
+ * keep them alive until vk_work_group_wait() on their group returns. */
+typedef struct vk_work			vk_work_t;
+typedef struct vk_work_group	vk_work_group_t;
+
+struct vk_work {
+	void				(*func)(vk_work_t *);
+	vk_work_group_t		 *group;
+	vk_work_t			 *next;
+	vk_bool_t			  done;
+};
+
+struct vk_work_group {
+	uint32_t			 pending;
+};
+
+void
+vk_work_group_init(vk_work_group_t *group);
+
+void
+vk_work_submit(vk_work_group_t *group, vk_work_t *work);
+
+void
+vk_work_group_wait(vk_work_group_t *group);
+
+vk_bool_t
+vk_work_group_done(vk_work_group_t *group);
+
+/* Waits for a single item of a group, the item stays owned by the caller. */
+void
+vk_work_wait(vk_work_t *work);
+
 #endif	/* UTILS_H */
@@ -0,0 +1,193 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Small pool of worker threads shared by the whole module.
+ *
+ * Work items are queued in FIFO order and run by the first idle worker. Items are owned by the
+ * caller, which usually keeps them on its stack and waits for their group before returning. The
+ * threads are started on the first submission; VK_TIZEN_WORK_THREADS sets their number, and 0
+ * makes vk_work_submit() run every item in the calling thread. */
+#define WORK_THREADS_DEFAULT	3
+#define WORK_THREADS_MAX		16
+
+static pthread_once_t		 work_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t		 work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 work_cond = PTHREAD_COND_INITIALIZER;	/* Work queued or stop. */
+static pthread_cond_t		 work_done_cond = PTHREAD_COND_INITIALIZER;
+static vk_bool_t			 work_stop;
+
+static vk_work_t			*work_head;
+static vk_work_t			*work_tail;
+
+static uint32_t				 work_thread_count;
+static pthread_t			 work_threads[WORK_THREADS_MAX];
+
+static void *
+work_thread_main(void *data)
+{
+	pthread_mutex_lock(&work_mutex);
+
+	for (;;) {
+		vk_work_t		*work;
+		vk_work_group_t	*group;
+
+		while (!work_head && !work_stop)
+			pthread_cond_wait(&work_cond, &work_mutex);
+
+		if (!work_head)
+			break;
+
+		work = work_head;
+		work_head = work->next;
+		if (!work_head)
+			work_tail = NULL;
+
+		pthread_mutex_unlock(&work_mutex);
+
+		/* The item may be gone once its group is done, read what is needed first. */
+		group = work->group;
+		work->func(work);
+
+		pthread_mutex_lock(&work_mutex);
+
+		/* Waiters may wait for the item alone. */
+		work->done = VK_TRUE;
+		--group->pending;
+		pthread_cond_broadcast(&work_done_cond);
+	}
+
+	pthread_mutex_unlock(&work_mutex);
+	return NULL;
+}
+
+static void
+work_init(void)
+{
+	const char	*env = getenv("VK_TIZEN_WORK_THREADS");
+	uint32_t	 count = WORK_THREADS_DEFAULT;
+
+	if (env)
+		count = MIN((uint32_t)strtoul(env, NULL, 10), WORK_THREADS_MAX);
+
+	for (work_thread_count = 0; work_thread_count < count; work_thread_count++) {
+		if (pthread_create(&work_threads[work_thread_count], NULL, work_thread_main, NULL)) {
+			VK_WARN("pthread_create() failed, %u work threads.\n", work_thread_count);
+			break;
+		}
+	}
+}
+
+static void __attribute__((destructor))
+work_fini(void)
+{
+	uint32_t i;
+
+	if (!work_thread_count)
+		return;
+
+	pthread_mutex_lock(&work_mutex);
+	work_stop = VK_TRUE;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	for (i = 0; i < work_thread_count; i++)
+		pthread_join(work_threads[i], NULL);
+
+	work_thread_count = 0;
+}
+
+void
+vk_work_group_init(vk_work_group_t *group)
+{
+	group->pending = 0;
+}
+
+void
+vk_work_submit(vk_work_group_t *group, vk_work_t *work)
+{
+	pthread_once(&work_once, work_init);
+
+	work->group = group;
+	work->done = VK_FALSE;
+
+	if (!work_thread_count) {
+		work->func(work);
+		work->done = VK_TRUE;
+		return;
+	}
+
+	work->next = NULL;
+
+	pthread_mutex_lock(&work_mutex);
+
+	group->pending++;
+
+	if (work_tail)
+		work_tail->next = work;
+	else
+		work_head = work;
+	work_tail = work;
+
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+}
+
+void
+vk_work_group_wait(vk_work_group_t *group)
+{
+	pthread_mutex_lock(&work_mutex);
+
+	while (group->pending)
+		pthread_cond_wait(&work_done_cond, &work_mutex);
+
+	pthread_mutex_unlock(&work_mutex);
+}
+
+vk_bool_t
+vk_work_group_done(vk_work_group_t *group)
+{
+	vk_bool_t done;
+
+	pthread_mutex_lock(&work_mutex);
+	done = group->pending == 0;
+	pthread_mutex_unlock(&work_mutex);
+
+	return done;
+}
+
+void
+vk_work_wait(vk_work_t *work)
+{
+	pthread_mutex_lock(&work_mutex);
+
+	while (!work->done)
+		pthread_cond_wait(&work_done_cond, &work_mutex);
+
+	pthread_mutex_unlock(&work_mutex);
+}
@@ -24,17 +24,51 @@
 
 #include "wsi.h"
 #include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdio.h>
+
+/* Alignment malloc() guarantees on every supported ABI. */
+#define MALLOC_ALIGNMENT	(2 * sizeof(void *))
 
 static void *
 default_alloc(void *data, size_t size, size_t align, VkSystemAllocationScope allocationScope)
 {
-	return malloc(size);
+	void *mem;
+
+	if (align <= MALLOC_ALIGNMENT)
+		return malloc(size);
+
+	if (posix_memalign(&mem, align, size) != 0)
+		return NULL;
+
+	return mem;
 }
 
 static void *
 default_realloc(void *data, void *mem, size_t size, size_t align, VkSystemAllocationScope scope)
 {
-	return realloc(mem, size);
+	void	*new_mem;
+	size_t	 old_size;
+
+	if (align <= MALLOC_ALIGNMENT || !mem)
+		return mem ? realloc(mem, size) : default_alloc(data, size, align, scope);
+
+	if (size == 0) {
+		free(mem);
+		return NULL;
+	}
+
+	/* realloc() does not preserve over-aligned allocations. */
+	new_mem = default_alloc(data, size, align, scope);
+	if (!new_mem)
+		return NULL;
+
+	old_size = malloc_usable_size(mem);
+	memcpy(new_mem, mem, MIN(old_size, size));
+	free(mem);
+
+	return new_mem;
 }
 
 static void
@@ -50,33 +84,336 @@ static const VkAllocationCallbacks default_allocator = {
 	.pfnFree = default_free,
 };
 
+/* Picks the allocator of a new object: the one given by the application, then the one its parent
+ * was created with, then the default one. */
 const VkAllocationCallbacks *
 vk_get_allocator(void							*parent,
 				 const VkAllocationCallbacks	*allocator)
 {
+	if (allocator)
+		return allocator;
+
+	if (parent) {
+		allocator = vk_get_parent_allocator(parent);
+		if (allocator)
+			return allocator;
+	}
+
 	return &default_allocator;
 }
 
+/* Allocation statistics.
+ *
+ * When enabled, every block is prefixed with a header recording its size, scope and call site,
+ * so that vk_free() can account for it whatever allocator it came from. The switch is read once
+ * at load time and never changes, so blocks with and without headers never mix. */
+#define ALLOC_STATS_SCOPE_COUNT	(VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1)
+#define ALLOC_STATS_SITE_COUNT	256
+
+typedef struct alloc_header	alloc_header_t;
+typedef struct alloc_site	alloc_site_t;
+
+struct alloc_header {
+	size_t						 size;
+	const char					*site;
+	VkSystemAllocationScope		 scope;
+};
+
+#define ALLOC_HEADER_SIZE	VK_ALLOC_SIZE(sizeof(alloc_header_t))
+
+struct alloc_site {
+	const char			*name;
+	vk_alloc_stats_t	 stats;
+};
+
+static vk_bool_t		 alloc_stats_on;
+static pthread_mutex_t	 alloc_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vk_alloc_stats_t	 alloc_stats_scopes[ALLOC_STATS_SCOPE_COUNT];
+static vk_alloc_stats_t	 alloc_stats_total;	/* Peaks of the scopes do not add up. */
+static alloc_site_t		 alloc_stats_sites[ALLOC_STATS_SITE_COUNT];
+static uint32_t			 alloc_stats_site_count;
+
+static void __attribute__((constructor))
+alloc_stats_init(void)
+{
+	const char *env = getenv("VK_TIZEN_ALLOC_STATS");
+
+	alloc_stats_on = env && strcmp(env, "0") != 0;
+}
+
+vk_bool_t
+vk_alloc_stats_enabled(void)
+{
+	return alloc_stats_on;
+}
+
+static uint32_t
+alloc_stats_bucket(size_t size)
+{
+	uint32_t bucket;
+
+	if (size <= 16)
+		return 0;
+
+	bucket = (sizeof(unsigned long long) * 8 - __builtin_clzll(size - 1)) - 4;
+
+	return MIN(bucket, VK_ALLOC_STATS_BUCKET_COUNT - 1);
+}
+
+/* Must be called with alloc_stats_mutex held. */
+static vk_alloc_stats_t *
+alloc_stats_site(const char *name)
+{
+	uint32_t i;
+
+	/* Sites are string literals, compare them by address first. */
+	for (i = 0; i < alloc_stats_site_count; i++) {
+		if (alloc_stats_sites[i].name == name)
+			return &alloc_stats_sites[i].stats;
+	}
+
+	for (i = 0; i < alloc_stats_site_count; i++) {
+		if (strcmp(alloc_stats_sites[i].name, name) == 0)
+			return &alloc_stats_sites[i].stats;
+	}
+
+	if (alloc_stats_site_count == ALLOC_STATS_SITE_COUNT)
+		return NULL;
+
+	alloc_stats_sites[alloc_stats_site_count].name = name;
+	return &alloc_stats_sites[alloc_stats_site_count++].stats;
+}
+
+static void
+alloc_stats_add(vk_alloc_stats_t *stats, size_t size, vk_bool_t realloc)
+{
+	if (!stats)
+		return;
+
+	if (realloc)
+		stats->realloc_count++;
+	else
+		stats->alloc_count++;
+
+	stats->live_bytes += size;
+	stats->peak_bytes = MAX(stats->peak_bytes, stats->live_bytes);
+	stats->histogram[alloc_stats_bucket(size)]++;
+}
+
+static void
+alloc_stats_remove(vk_alloc_stats_t *stats, size_t size, vk_bool_t realloc)
+{
+	if (!stats)
+		return;
+
+	if (!realloc)
+		stats->free_count++;
+
+	stats->live_bytes -= size;
+}
+
+static void
+alloc_stats_record(const alloc_header_t *old, const alloc_header_t *new)
+{
+	vk_bool_t realloc = old && new;
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+
+	if (old) {
+		alloc_stats_remove(&alloc_stats_total, old->size, realloc);
+		alloc_stats_remove(&alloc_stats_scopes[old->scope], old->size, realloc);
+		alloc_stats_remove(alloc_stats_site(old->site), old->size, realloc);
+	}
+
+	if (new) {
+		alloc_stats_add(&alloc_stats_total, new->size, realloc);
+		alloc_stats_add(&alloc_stats_scopes[new->scope], new->size, realloc);
+		alloc_stats_add(alloc_stats_site(new->site), new->size, realloc);
+	}
+
+	pthread_mutex_unlock(&alloc_stats_mutex);
+}
+
+static VkSystemAllocationScope
+alloc_stats_scope(VkSystemAllocationScope scope)
+{
+	return (uint32_t)scope < ALLOC_STATS_SCOPE_COUNT ? scope : VK_SYSTEM_ALLOCATION_SCOPE_OBJECT;
+}
+
+static void *
+alloc_stats_alloc(const VkAllocationCallbacks	*allocator,
+				  size_t						 size,
+				  VkSystemAllocationScope		 scope,
+				  const char					*site)
+{
+	alloc_header_t *header;
+
+	header = allocator->pfnAllocation(allocator->pUserData, ALLOC_HEADER_SIZE + size,
+									  VK_ALLOC_ALIGNMENT, scope);
+	if (!header)
+		return NULL;
+
+	header->size = size;
+	header->site = site;
+	header->scope = alloc_stats_scope(scope);
+	alloc_stats_record(NULL, header);
+
+	return (char *)header + ALLOC_HEADER_SIZE;
+}
+
+static void *
+alloc_stats_realloc(const VkAllocationCallbacks	*allocator,
+					void						*mem,
+					size_t						 size,
+					VkSystemAllocationScope		 scope,
+					const char					*site)
+{
+	alloc_header_t	*header, old;
+
+	if (!mem)
+		return alloc_stats_alloc(allocator, size, scope, site);
+
+	if (size == 0) {
+		vk_free(allocator, mem);
+		return NULL;
+	}
+
+	header = (alloc_header_t *)((char *)mem - ALLOC_HEADER_SIZE);
+	old = *header;
+
+	header = allocator->pfnReallocation(allocator->pUserData, header, ALLOC_HEADER_SIZE + size,
+										VK_ALLOC_ALIGNMENT, scope);
+	if (!header)
+		return NULL;
+
+	header->size = size;
+	header->site = site;
+	header->scope = alloc_stats_scope(scope);
+	alloc_stats_record(&old, header);
+
+	return (char *)header + ALLOC_HEADER_SIZE;
+}
+
+vk_bool_t
+vk_alloc_stats_get(VkSystemAllocationScope scope, vk_alloc_stats_t *stats)
+{
+	if (!alloc_stats_on)
+		return VK_FALSE;
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+
+	if ((uint32_t)scope < ALLOC_STATS_SCOPE_COUNT)
+		*stats = alloc_stats_scopes[scope];
+	else
+		*stats = alloc_stats_total;
+
+	pthread_mutex_unlock(&alloc_stats_mutex);
+	return VK_TRUE;
+}
+
+uint32_t
+vk_alloc_stats_get_sites(uint32_t count, const char **sites, vk_alloc_stats_t *stats)
+{
+	uint32_t i, site_count;
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+
+	site_count = alloc_stats_site_count;
+
+	for (i = 0; i < MIN(count, site_count); i++) {
+		sites[i] = alloc_stats_sites[i].name;
+		stats[i] = alloc_stats_sites[i].stats;
+	}
+
+	pthread_mutex_unlock(&alloc_stats_mutex);
+	return site_count;
+}
+
+static void
+alloc_stats_print(const char *name, const vk_alloc_stats_t *stats)
+{
+	char		hist[VK_ALLOC_STATS_BUCKET_COUNT * 21 + 1];
+	size_t		len = 0;
+	uint32_t	i;
+
+	hist[0] = '\0';
+
+	for (i = 0; i < VK_ALLOC_STATS_BUCKET_COUNT; i++) {
+		len += snprintf(hist + len, sizeof(hist) - len, "%s%llu", i ? "," : "",
+						(unsigned long long)stats->histogram[i]);
+	}
+
+	/* Statistics were asked for explicitly, bypass the log level. */
+	vk_log(VK_LOG_LEVEL_INFO, __FILE__, __LINE__,
+		   "alloc %s: live %llu peak %llu allocs %llu reallocs %llu frees %llu histogram [%s]", name,
+		   (unsigned long long)stats->live_bytes, (unsigned long long)stats->peak_bytes,
+		   (unsigned long long)stats->alloc_count, (unsigned long long)stats->realloc_count,
+		   (unsigned long long)stats->free_count, hist);
+}
+
+void
+vk_alloc_stats_dump(void)
+{
+	static const char *scope_names[ALLOC_STATS_SCOPE_COUNT] = {
+		"command", "object", "cache", "device", "instance",
+	};
+
+	vk_alloc_stats_t	stats;
+	uint32_t			i;
+
+	if (!vk_alloc_stats_get(VK_SYSTEM_ALLOCATION_SCOPE_MAX_ENUM, &stats))
+		return;
+
+	alloc_stats_print("total", &stats);
+
+	for (i = 0; i < ALLOC_STATS_SCOPE_COUNT; i++) {
+		vk_alloc_stats_get(i, &stats);
+		alloc_stats_print(scope_names[i], &stats);
+	}
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+
+	for (i = 0; i < alloc_stats_site_count; i++)
+		alloc_stats_print(alloc_stats_sites[i].name, &alloc_stats_sites[i].stats);
+
+	pthread_mutex_unlock(&alloc_stats_mutex);
+}
+
 void *
-vk_alloc(const VkAllocationCallbacks	*allocator,
-		 size_t							 size,
-		 VkSystemAllocationScope		 scope)
+vk_alloc_site(const VkAllocationCallbacks	*allocator,
+			  size_t						 size,
+			  VkSystemAllocationScope		 scope,
+			  const char					*site)
 {
-	return allocator->pfnAllocation(allocator->pUserData, size, 1, scope);
+	if (__builtin_expect(alloc_stats_on, 0))
+		return alloc_stats_alloc(allocator, size, scope, site);
+
+	return allocator->pfnAllocation(allocator->pUserData, size, VK_ALLOC_ALIGNMENT, scope);
 }
 
 void *
-vk_realloc(const VkAllocationCallbacks	*allocator,
-		   void							*mem,
-		   size_t						 size,
-		   VkSystemAllocationScope		 scope)
+vk_realloc_site(const VkAllocationCallbacks	*allocator,
+				void						*mem,
+				size_t						 size,
+				VkSystemAllocationScope		 scope,
+				const char					*site)
 {
-	return allocator->pfnReallocation(allocator->pUserData, mem, size, 1, scope);
+	if (__builtin_expect(alloc_stats_on, 0))
+		return alloc_stats_realloc(allocator, mem, size, scope, site);
+
+	return allocator->pfnReallocation(allocator->pUserData, mem, size, VK_ALLOC_ALIGNMENT, scope);
 }
 
 void
 vk_free(const VkAllocationCallbacks		*allocator,
 		void							*mem)
 {
+	if (__builtin_expect(alloc_stats_on, 0) && mem) {
+		alloc_header_t *header = (alloc_header_t *)((char *)mem - ALLOC_HEADER_SIZE);
+
+		alloc_stats_record(header, NULL);
+		mem = header;
+	}
+
 	allocator->pfnFree(allocator->pUserData, mem);
 }
@@ -0,0 +1,313 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Microbenchmarks for the WSI module.
+ *
+ * The module sources are built into the program, and entry-points.c is included here directly so
+ * that its static lookup table can be timed. Results are printed as CSV, one line per
+ * measurement:
+ *   suite,case,count,ns_per_op
+ *
+ * ns_per_op is the mean over batches of count operations, repeated until at least MIN_BATCH_OPS
+ * operations ran. */
+
+#include "entry-points.c"
+#include <stdio.h>
+#include <time.h>
+
+#define MIN_BATCH_OPS		(1 << 20)
+#define DISPLAY_INIT_OPS	64
+#define COMMIT_FRAMES		60
+
+static volatile uintptr_t	sink;
+
+/* Names the loader queries which the WSI does not implement and hands over to the ICD. */
+static const char *missing_names[] = {
+	"vkCreateBuffer",
+	"vkDestroyBuffer",
+	"vkCreateImage",
+	"vkCmdDraw",
+	"vkCmdDrawIndexed",
+	"vkCmdBindPipeline",
+	"vkQueueSubmit",
+	"vkAllocateMemory",
+	"vkMapMemory",
+	"vkCreateCommandPool",
+	"vkGetPhysicalDeviceProperties",
+	"vkGetPhysicalDeviceFeatures",
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+report(const char *suite, const char *name, uint32_t count, uint64_t total_ns)
+{
+	printf("%s,%s,%u,%.2f\n", suite, name, count, (double)total_ns / count);
+}
+
+/* The lookup used before the perfect hash table. */
+static const vk_entry_t *
+get_entry_point_linear(const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < ARRAY_LENGTH(entry_points); ++i) {
+		if (strcmp(entry_points[i].name, name) == 0)
+			return &entry_points[i];
+	}
+
+	return NULL;
+}
+
+static void
+bench_lookup(const char *name, const vk_entry_t *(*lookup)(const char *),
+			 const char **names, uint32_t name_count)
+{
+	uint64_t	start;
+	uint32_t	i, count = 0;
+
+	start = now_ns();
+
+	while (count < MIN_BATCH_OPS) {
+		for (i = 0; i < name_count; i++)
+			sink += (uintptr_t)lookup(names[i]);
+
+		count += name_count;
+	}
+
+	report("entry_points", name, count, now_ns() - start);
+}
+
+static void
+bench_entry_points(void)
+{
+	const char	*hit_names[ARRAY_LENGTH(entry_points)];
+	uint32_t	 i;
+
+	for (i = 0; i < ARRAY_LENGTH(entry_points); i++)
+		hit_names[i] = entry_points[i].name;
+
+	/* Build the table outside of the measurement. */
+	get_entry_point(hit_names[0]);
+
+	bench_lookup("hash_hit", get_entry_point, hit_names, ARRAY_LENGTH(hit_names));
+	bench_lookup("linear_hit", get_entry_point_linear, hit_names, ARRAY_LENGTH(hit_names));
+	bench_lookup("hash_miss", get_entry_point, missing_names, ARRAY_LENGTH(missing_names));
+	bench_lookup("linear_miss", get_entry_point_linear, missing_names,
+				 ARRAY_LENGTH(missing_names));
+}
+
+/* Physical device registration used to build the display state right away, so every process
+ * loading the module paid for TDM. eager_register times that former cost, lazy_register what
+ * registration does now, and get_display the query every display entry point makes once the
+ * state is built. */
+static void
+bench_display(void)
+{
+	static vk_physical_device_t	 phydev;
+	static int					 handle;
+	uint64_t					 start;
+	uint32_t					 i;
+
+	phydev.allocator = vk_get_allocator(NULL, NULL);
+
+	if (!vk_physical_device_init_display(&phydev)) {
+		fprintf(stderr, "TDM display not available, skipping display suite.\n");
+		return;
+	}
+
+	vk_physical_device_fini_display(&phydev);
+
+	start = now_ns();
+
+	for (i = 0; i < DISPLAY_INIT_OPS; i++) {
+		memset(&phydev, 0x00, sizeof(phydev));
+		phydev.allocator = vk_get_allocator(NULL, NULL);
+		pthread_mutex_init(&phydev.mutex, NULL);
+		vk_physical_device_init_display(&phydev);
+		vk_physical_device_fini_display(&phydev);
+		pthread_mutex_destroy(&phydev.mutex);
+	}
+
+	report("display", "eager_register", DISPLAY_INIT_OPS, now_ns() - start);
+
+	start = now_ns();
+
+	for (i = 0; i < MIN_BATCH_OPS; i++) {
+		memset(&phydev, 0x00, sizeof(phydev));
+		phydev.allocator = vk_get_allocator(NULL, NULL);
+		pthread_mutex_init(&phydev.mutex, NULL);
+		pthread_mutex_init(&phydev.tdm_mutex, NULL);
+		pthread_cond_init(&phydev.tdm_cond, NULL);
+		pthread_cond_destroy(&phydev.tdm_cond);
+		pthread_mutex_destroy(&phydev.tdm_mutex);
+		pthread_mutex_destroy(&phydev.mutex);
+		sink += (uintptr_t)phydev.allocator;
+	}
+
+	report("display", "lazy_register", MIN_BATCH_OPS, now_ns() - start);
+
+	/* Any unique pointer works as a handle, the first query registers it and builds the state. */
+	vk_physical_device_get_display((VkPhysicalDevice)&handle);
+
+	start = now_ns();
+
+	for (i = 0; i < MIN_BATCH_OPS; i++)
+		sink += (uintptr_t)vk_physical_device_get_display((VkPhysicalDevice)&handle);
+
+	report("display", "get_display", MIN_BATCH_OPS, now_ns() - start);
+}
+
+typedef struct commit_thread	commit_thread_t;
+
+struct commit_thread {
+	vk_physical_device_t	*pdev;
+	tdm_output				*output;
+	vk_bool_t				 pending;
+	VkResult				 res;
+	pthread_t				 thread;
+};
+
+static void
+commit_done(tdm_output *output, unsigned int sequence,
+			unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	*(vk_bool_t *)user_data = VK_FALSE;
+}
+
+/* Commits the output unchanged and waits for the flip the way TDM swapchains do. */
+static VkResult
+commit_output(commit_thread_t *thread)
+{
+	VkResult res = VK_SUCCESS;
+
+	pthread_mutex_lock(&thread->pdev->tdm_mutex);
+
+	thread->pending = VK_TRUE;
+
+	if (tdm_output_commit(thread->output, 0, commit_done, &thread->pending) != TDM_ERROR_NONE) {
+		thread->pending = VK_FALSE;
+		res = VK_ERROR_SURFACE_LOST_KHR;
+	}
+
+	if (vk_physical_device_wait_tdm_commit(thread->pdev, &thread->pending) != VK_SUCCESS)
+		res = VK_ERROR_SURFACE_LOST_KHR;
+
+	pthread_mutex_unlock(&thread->pdev->tdm_mutex);
+	return res;
+}
+
+static void *
+commit_thread_main(void *data)
+{
+	commit_thread_t	*thread = data;
+	uint32_t		 i;
+
+	for (i = 0; i < COMMIT_FRAMES && thread->res == VK_SUCCESS; i++)
+		thread->res = commit_output(thread);
+
+	return NULL;
+}
+
+/* Presenting N outputs from N threads should take about one vblank per frame, as the outputs flip
+ * on the same vblank. serial presents them one after another from a single thread, which is what
+ * holding tdm_mutex until the flip amounted to. Both report the time per frame of all outputs. */
+static void
+bench_tdm_commit(void)
+{
+	static vk_physical_device_t	 phydev;
+	commit_thread_t				 threads[VK_MAX_DISPLAY_COUNT];
+	uint64_t					 start;
+	uint32_t					 i, j, count;
+
+	memset(&phydev, 0x00, sizeof(phydev));
+	phydev.allocator = vk_get_allocator(NULL, NULL);
+	pthread_mutex_init(&phydev.tdm_mutex, NULL);
+	pthread_cond_init(&phydev.tdm_cond, NULL);
+
+	if (!vk_physical_device_init_display(&phydev)) {
+		fprintf(stderr, "TDM display not available, skipping tdm_commit suite.\n");
+		goto done;
+	}
+
+	count = phydev.display_count;
+	memset(threads, 0x00, sizeof(threads));
+	fprintf(stderr, "tdm_commit: %u outputs.\n", count);
+
+	for (i = 0; i < count; i++) {
+		threads[i].pdev = &phydev;
+		threads[i].output = phydev.displays[i].tdm_output;
+
+		if (commit_output(&threads[i]) != VK_SUCCESS) {
+			fprintf(stderr, "Output %u cannot be committed, skipping tdm_commit suite.\n", i);
+			goto fini;
+		}
+	}
+
+	start = now_ns();
+
+	for (j = 0; j < COMMIT_FRAMES; j++) {
+		for (i = 0; i < count; i++)
+			commit_output(&threads[i]);
+	}
+
+	report("tdm_commit", "serial", COMMIT_FRAMES, now_ns() - start);
+
+	start = now_ns();
+
+	for (i = 0; i < count; i++)
+		pthread_create(&threads[i].thread, NULL, commit_thread_main, &threads[i]);
+
+	for (i = 0; i < count; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	report("tdm_commit", "parallel", COMMIT_FRAMES, now_ns() - start);
+
+fini:
+	vk_physical_device_fini_display(&phydev);
+
+done:
+	pthread_cond_destroy(&phydev.tdm_cond);
+	pthread_mutex_destroy(&phydev.tdm_mutex);
+}
+
+int
+main(int argc, char **argv)
+{
+	printf("suite,case,count,ns_per_op\n");
+
+	bench_entry_points();
+	bench_display();
+	bench_tdm_commit();
+
+	return 0;
+}
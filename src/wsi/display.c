@@ -24,6 +24,8 @@
 
 #include "wsi.h"
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 
 static void
 add_tdm_layer(vk_physical_device_t *pdev, tdm_layer *layer,
@@ -76,8 +78,10 @@ add_tdm_output(vk_physical_device_t *pdev, tdm_output *output)
 	/* Initialize modes. */
 	tdm_output_get_available_modes(output, &modes, &count);
 	if (count > 0) {
-		display->built_in_modes = calloc(count, sizeof(vk_display_mode_t));
-		VK_CHECK(display->built_in_modes, return, "calloc() failed.\n");
+		display->built_in_modes = vk_alloc(pdev->allocator, count * sizeof(vk_display_mode_t),
+										   VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+		VK_CHECK(display->built_in_modes, return, "vk_alloc() failed.\n");
+		memset(display->built_in_modes, 0x00, count * sizeof(vk_display_mode_t));
 
 		for (i = 0; i < count; i++) {
 			display->built_in_modes[i].display = display;
@@ -135,10 +139,10 @@ static void
 display_fini(vk_display_t *display)
 {
 	if (display->built_in_modes)
-		free(display->built_in_modes);
+		vk_free(display->pdev->allocator, display->built_in_modes);
 
 	if (display->custom_modes)
-		free(display->custom_modes);
+		vk_free(display->pdev->allocator, display->custom_modes);
 }
 
 void
@@ -192,14 +196,93 @@ error:
 	return VK_FALSE;
 }
 
+vk_physical_device_t *
+vk_physical_device_get_display(VkPhysicalDevice pdev)
+{
+	vk_physical_device_t *phydev = vk_get_physical_device(pdev);
+
+	if (!phydev)
+		return NULL;
+
+	/* TDM is only touched by processes that actually use VK_KHR_display. */
+	if (!__atomic_load_n(&phydev->display_initialized, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&phydev->mutex);
+
+		if (!phydev->display_initialized) {
+			vk_physical_device_init_display(phydev);
+			__atomic_store_n(&phydev->display_initialized, VK_TRUE, __ATOMIC_RELEASE);
+		}
+
+		pthread_mutex_unlock(&phydev->mutex);
+	}
+
+	return phydev;
+}
+
+/* Handles events on the TDM display until a commit handler clears *pending. Called and returns
+ * with tdm_mutex held.
+ *
+ * One thread at a time dispatches. It waits for the display fd with tdm_mutex released, so other
+ * outputs can be committed meanwhile, and dispatches with it held, so handlers never run
+ * concurrently with a commit. The handlers of other threads may run in that dispatch, those
+ * threads sleep on tdm_cond and check their flag again after each one. */
+VkResult
+vk_physical_device_wait_tdm_commit(vk_physical_device_t *pdev, vk_bool_t *pending)
+{
+	struct pollfd	fds;
+	tdm_error		err;
+	int				fd;
+
+	while (*pending) {
+		if (pdev->tdm_dispatching) {
+			pthread_cond_wait(&pdev->tdm_cond, &pdev->tdm_mutex);
+			continue;
+		}
+
+		err = tdm_display_get_fd(pdev->tdm_display, &fd);
+		VK_CHECK(err == TDM_ERROR_NONE, goto error, "tdm_display_get_fd() failed.\n");
+
+		pdev->tdm_dispatching = VK_TRUE;
+		pthread_mutex_unlock(&pdev->tdm_mutex);
+
+		fds.fd = fd;
+		fds.events = POLLIN;
+		fds.revents = 0;
+
+		VK_TRACE_BEGIN("tdm_display_poll");
+		while (poll(&fds, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+			;
+		VK_TRACE_END("tdm_display_poll");
+
+		pthread_mutex_lock(&pdev->tdm_mutex);
+
+		VK_TRACE_BEGIN("tdm_display_handle_events");
+		err = tdm_display_handle_events(pdev->tdm_display);
+		VK_TRACE_END("tdm_display_handle_events");
+
+		pdev->tdm_dispatching = VK_FALSE;
+		pthread_cond_broadcast(&pdev->tdm_cond);
+
+		VK_CHECK(err == TDM_ERROR_NONE, goto error, "tdm_display_handle_events() failed.\n");
+	}
+
+	return VK_SUCCESS;
+
+error:
+	*pending = VK_FALSE;
+	return VK_ERROR_SURFACE_LOST_KHR;
+}
+
 VKAPI_ATTR VkResult VKAPI_CALL
 vk_GetPhysicalDeviceDisplayPropertiesKHR(VkPhysicalDevice		 pdev,
 										 uint32_t				*prop_count,
 										 VkDisplayPropertiesKHR	*props)
 {
-	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
+	vk_physical_device_t	*phydev = vk_physical_device_get_display(pdev);
 	uint32_t				 i;
 
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_physical_device_get_display() failed.\n");
+
 	if (!props) {
 		*prop_count = phydev->display_count;
 		return VK_SUCCESS;
@@ -221,9 +304,11 @@ vk_GetPhysicalDeviceDisplayPlanePropertiesKHR(VkPhysicalDevice				 pdev,
 											  uint32_t						*prop_count,
 											  VkDisplayPlanePropertiesKHR	*props)
 {
-	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
+	vk_physical_device_t	*phydev = vk_physical_device_get_display(pdev);
 	uint32_t				 i;
 
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_physical_device_get_display() failed.\n");
+
 	if (!props) {
 		*prop_count = phydev->plane_count;
 		return VK_SUCCESS;
@@ -246,10 +331,13 @@ vk_GetDisplayPlaneSupportedDisplaysKHR(VkPhysicalDevice	 pdev,
 									   uint32_t			*display_count,
 									   VkDisplayKHR		*displays)
 {
-	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
-	vk_display_plane_t		*plane = &phydev->planes[plane_index];
+	vk_physical_device_t	*phydev = vk_physical_device_get_display(pdev);
+	vk_display_plane_t		*plane;
 	uint32_t				 i;
 
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_physical_device_get_display() failed.\n");
+	plane = &phydev->planes[plane_index];
+
 	if (!displays) {
 		*display_count = plane->supported_display_count;
 		return VK_SUCCESS;
@@ -323,8 +411,10 @@ vk_CreateDisplayModeKHR(VkPhysicalDevice					 pdev,
 	}
 
 	/* can't found */
-	allocator = allocator ? allocator : vk_get_allocator(NULL, allocator);
-	disp_mode = vk_realloc(allocator, dpy->custom_modes,
+
+	/* Custom modes of a display share a single array which outlives this call, so it is owned
+	 * by the physical device allocator rather than the one given here. */
+	disp_mode = vk_realloc(dpy->pdev->allocator, dpy->custom_modes,
 						   sizeof(vk_display_mode_t) * (dpy->custom_mode_count + 1),
 						   VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
 	VK_CHECK(disp_mode, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
@@ -352,9 +442,13 @@ vk_GetDisplayPlaneCapabilitiesKHR(VkPhysicalDevice				 pdev,
 {
 	int min_w, min_h, max_w, max_h;
 	tdm_error tdm_err;
-	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
-	vk_display_plane_t		*plane = &phydev->planes[plane_index];
-	vk_display_t			*disp = plane->current_display;
+	vk_physical_device_t	*phydev = vk_physical_device_get_display(pdev);
+	vk_display_plane_t		*plane;
+	vk_display_t			*disp;
+
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_physical_device_get_display() failed.\n");
+	plane = &phydev->planes[plane_index];
+	disp = plane->current_display;
 
 	tdm_err = tdm_output_get_available_size(disp->tdm_output, &min_w, &min_h,
 											&max_w, &max_h, NULL);
@@ -23,6 +23,7 @@
  */
 
 #include "wsi.h"
+#include <pthread.h>
 #include <string.h>
 
 #define VK_ENTRY_POINT(name, type) { "vk"#name, vk_##name, VK_FUNC_TYPE_##type }
@@ -61,33 +62,134 @@ static const vk_entry_t	entry_points[] = {
 	VK_ENTRY_POINT(CreateDisplayModeKHR, INSTANCE),
 	VK_ENTRY_POINT(GetDisplayPlaneCapabilitiesKHR, INSTANCE),
 	VK_ENTRY_POINT(CreateSharedSwapchainsKHR, DEVICE),
+	VK_ENTRY_POINT(GetRefreshCycleDurationGOOGLE, DEVICE),
+	VK_ENTRY_POINT(GetPastPresentationTimingGOOGLE, DEVICE),
 	VK_ENTRY_POINT(GetPhysicalDeviceWaylandPresentationSupportKHR,INSTANCE),
 	VK_ENTRY_POINT(GetInstanceProcAddr, INSTANCE),
 	VK_ENTRY_POINT(GetDeviceProcAddr, DEVICE),
+	VK_ENTRY_POINT(CreateInstance, GLOBAL),
+	VK_ENTRY_POINT(DestroyInstance, INSTANCE),
+	VK_ENTRY_POINT(EnumeratePhysicalDevices, INSTANCE),
+	VK_ENTRY_POINT(CreateDevice, INSTANCE),
+	VK_ENTRY_POINT(DestroyDevice, DEVICE),
 	VK_ENTRY_POINT(CreateTBMQueueSurfaceKHR, INSTANCE),
 };
 
+/* Perfect hash table over entry_points[]. The seed and the table size are searched once, on the
+ * first lookup, so that every entry point lands on its own slot. A lookup then costs one hash of
+ * the name plus a single strcmp() against the only candidate. */
+#define ENTRY_HASH_BITS_MIN		6
+#define ENTRY_HASH_BITS_MAX		10
+#define ENTRY_HASH_SEED_TRIES	4096
+
+static struct {
+	uint32_t	seed;
+	uint32_t	mask;
+	uint8_t		slots[1 << ENTRY_HASH_BITS_MAX];	/* entry index + 1, 0 if empty. */
+} entry_hash;
+
+static pthread_once_t entry_hash_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t
+entry_hash_string(const char *name, uint32_t seed)
+{
+	/* FNV-1a with the seed folded into the offset basis. */
+	uint32_t hash = 2166136261u ^ seed;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6du;
+	hash ^= hash >> 12;
+
+	return hash;
+}
+
+static vk_bool_t
+entry_hash_try(uint32_t seed, uint32_t mask)
+{
+	uint32_t i;
+
+	memset(entry_hash.slots, 0x00, sizeof(entry_hash.slots));
+
+	for (i = 0; i < ARRAY_LENGTH(entry_points); i++) {
+		uint32_t index = entry_hash_string(entry_points[i].name, seed) & mask;
+
+		if (entry_hash.slots[index])
+			return VK_FALSE;
+
+		entry_hash.slots[index] = i + 1;
+	}
+
+	entry_hash.seed = seed;
+	entry_hash.mask = mask;
+
+	return VK_TRUE;
+}
+
+static void
+entry_hash_build(void)
+{
+	uint32_t bits, seed;
+
+	VK_ASSERT(ARRAY_LENGTH(entry_points) < 255);
+
+	for (bits = ENTRY_HASH_BITS_MIN; bits <= ENTRY_HASH_BITS_MAX; bits++) {
+		if ((1u << bits) < ARRAY_LENGTH(entry_points) * 2)
+			continue;
+
+		for (seed = 0; seed < ENTRY_HASH_SEED_TRIES; seed++) {
+			if (entry_hash_try(seed, (1u << bits) - 1))
+				return;
+		}
+	}
+
+	/* Not reachable for any sane number of entry points. Leave the table empty so that lookups
+	 * fall back to the linear scan. */
+	VK_ERROR("Failed to build perfect hash for entry points.\n");
+	memset(entry_hash.slots, 0x00, sizeof(entry_hash.slots));
+	entry_hash.mask = 0;
+}
+
 static const vk_entry_t *
 get_entry_point(const char *name)
 {
-	/* TODO: Apply perfect hashing. */
+	const vk_entry_t	*entry;
+	uint32_t			 slot;
 
-	uint32_t i;
+	pthread_once(&entry_hash_once, entry_hash_build);
+
+	if (entry_hash.mask == 0) {
+		uint32_t i;
+
+		for (i = 0; i < ARRAY_LENGTH(entry_points); ++i) {
+			if (strcmp(entry_points[i].name, name) == 0)
+				return &entry_points[i];
+		}
 
-	for (i = 0; i < ARRAY_LENGTH(entry_points); ++i) {
-		if (strcmp(entry_points[i].name, name) == 0)
-			return &entry_points[i];
+		return NULL;
 	}
 
-	return NULL;
+	slot = entry_hash.slots[entry_hash_string(name, entry_hash.seed) & entry_hash.mask];
+	if (slot == 0)
+		return NULL;
+
+	entry = &entry_points[slot - 1];
+	if (strcmp(entry->name, name) != 0)
+		return NULL;
+
+	return entry;
 }
 
 VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
 vk_GetInstanceProcAddr(VkInstance instance, const char *name)
 {
-	vk_icd_t					*icd = vk_get_icd();
-	const vk_entry_t			*entry = get_entry_point(name);
-	PFN_vkGetInstanceProcAddr	 gipa;
+	vk_icd_t			*icd = vk_get_icd();
+	const vk_entry_t	*entry = get_entry_point(name);
+	vk_instance_t		*inst;
 
 	/* According to vulkan specification 1.0, when instance is NULL, name must be one of global
 	 * functions. When instance is not NULL, then name must be not one of global functions. */
@@ -107,18 +209,20 @@ vk_GetInstanceProcAddr(VkInstance instance, const char *name)
 		return NULL;
 	}
 
-	/* TODO: Avoid getting GIPA on the fly. */
-	gipa = (PFN_vkGetInstanceProcAddr)icd->get_proc_addr(instance, "vkGetInstanceProcAddr");
+	if (instance == NULL)
+		return icd->gipa(NULL, name);
+
+	inst = vk_get_instance(instance);
+	VK_CHECK(inst, return NULL, "vk_get_instance() failed.\n");
 
-	return gipa(instance, name);
+	return inst->gipa(instance, name);
 }
 
 VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
 vk_GetDeviceProcAddr(VkDevice device, const char *name)
 {
-	vk_icd_t				*icd = vk_get_icd();
-	const vk_entry_t		*entry = get_entry_point(name);
-	PFN_vkGetDeviceProcAddr	 gdpa;
+	const vk_entry_t	*entry = get_entry_point(name);
+	vk_device_t			*dev;
 
 	if (device == NULL)
 		return NULL;
@@ -130,12 +234,11 @@ vk_GetDeviceProcAddr(VkDevice device, const char *name)
 		return NULL;
 	}
 
-	/* TODO: We are trying to get the most specific device functions here. */
-	gdpa = (PFN_vkGetDeviceProcAddr)icd->get_proc_addr(NULL, "vkGetDeviceProcAddr");
-	gdpa = (PFN_vkGetDeviceProcAddr)gdpa(device, "vkGetDeviceProcAddr");
-
-	return gdpa(device, name);
+	/* The cached GDPA is the most specific one the ICD gave us for this device. */
+	dev = vk_get_device(device);
+	VK_CHECK(dev, return NULL, "vk_get_device() failed.\n");
 
+	return dev->gdpa(device, name);
 }
 
 VK_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
@@ -46,99 +46,152 @@ vk_EnumerateInstanceExtensionProperties(const char				*layer_name,
 	return VK_SUCCESS;
 }
 
+/* VK_GOOGLE_display_timing only works on TDM surfaces, tpl swapchains fail
+ * vkGetRefreshCycleDurationGOOGLE with VK_ERROR_SURFACE_LOST_KHR and report no past timings. */
 static const VkExtensionProperties wsi_device_extensions[] = {
 	{ VK_KHR_SWAPCHAIN_EXTENSION_NAME, 67 },
+	{ VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME, VK_KHR_INCREMENTAL_PRESENT_SPEC_VERSION },
+	{ VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME, VK_GOOGLE_DISPLAY_TIMING_SPEC_VERSION },
 };
 
-VKAPI_ATTR VkResult VKAPI_CALL
-vk_EnumerateDeviceExtensionProperties(VkPhysicalDevice		 pdev,
-									  const char			*layer_name,
-									  uint32_t				*count,
-									  VkExtensionProperties	*extensions)
+typedef struct vk_extension_list	vk_extension_list_t;
+
+struct vk_extension_list {
+	const VkAllocationCallbacks	*allocator;
+	uint32_t					 count;
+	VkExtensionProperties		 properties[];
+};
+
+static void
+extension_list_free(void *data)
 {
-	vk_icd_t	*icd = vk_get_icd();
-	uint32_t	 max_ext_count, remaining, copied = 0;
-	VkResult	 result;
-	uint32_t i, j, copy_count = 0;
+	vk_extension_list_t *list = data;
+
+	vk_free(list->allocator, list);
+}
 
-	result = icd->enum_dev_exts(pdev, layer_name, &max_ext_count, NULL);
-	VK_CHECK(result == VK_SUCCESS, return VK_ERROR_OUT_OF_HOST_MEMORY,
+static vk_extension_list_t *
+extension_list_create(vk_physical_device_t *phydev, const char *layer_name)
+{
+	VkPhysicalDevice	 pdev = phydev->pdev;
+	vk_icd_t			*icd = vk_get_icd();
+	vk_extension_list_t	*list;
+	uint32_t			 icd_count, i, j;
+	VkResult			 result;
+
+	result = icd->enum_dev_exts(pdev, layer_name, &icd_count, NULL);
+	VK_CHECK(result == VK_SUCCESS, return NULL, "vkEnumerateDeviceExtensionProperties() failed.\n");
+
+	list = vk_alloc(phydev->allocator,
+					sizeof(vk_extension_list_t) +
+					(icd_count + ARRAY_LENGTH(wsi_device_extensions)) *
+					sizeof(VkExtensionProperties),
+					VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+	VK_CHECK(list, return NULL, "vk_alloc() failed.\n");
+
+	list->allocator = phydev->allocator;
+
+	result = icd->enum_dev_exts(pdev, layer_name, &icd_count, list->properties);
+	VK_CHECK(result == VK_SUCCESS || result == VK_INCOMPLETE, goto error,
 			 "vkEnumerateDeviceExtensionProperties() failed.\n");
 
-	if (!extensions) {
-		/*
-		 * for CTS fail return count
-		 * loader remove duplicates extension
-		 * second called count is not same when extensions has duplicate entry
-		 */
-		VkExtensionProperties	*device_extensions =
-			vk_alloc(vk_get_allocator(NULL, NULL),
-					 max_ext_count * sizeof(VkExtensionProperties),
-					 VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
-		VK_CHECK(device_extensions, return VK_ERROR_OUT_OF_HOST_MEMORY, "malloc failed().\n");
-
-		result = icd->enum_dev_exts(pdev, layer_name, &max_ext_count, device_extensions);
-		VK_CHECK(result == VK_SUCCESS, return VK_ERROR_OUT_OF_HOST_MEMORY,
-				 "vkEnumerateDeviceExtensionProperties() failed.\n");
-
-		for (i = 0; i < ARRAY_LENGTH(wsi_device_extensions); i++) {
-			for (j = 0; j < max_ext_count; j++) {
-				if (strcmp(device_extensions[j].extensionName,
-						   wsi_device_extensions[i].extensionName) == 0) {
-					break;
-				}
-			}
-			if (j == max_ext_count)
-				copy_count++;
-		}
-		vk_free(vk_get_allocator(NULL, NULL), device_extensions);
+	/* Append WSI extensions the ICD does not already report. The loader removes duplicates, so
+	 * counting them would make the two calls of an enumeration disagree. */
+	list->count = icd_count;
 
-		*count = max_ext_count + copy_count;
+	for (i = 0; i < ARRAY_LENGTH(wsi_device_extensions); i++) {
+		for (j = 0; j < icd_count; j++) {
+			if (strcmp(list->properties[j].extensionName,
+					   wsi_device_extensions[i].extensionName) == 0)
+				break;
+		}
 
-		return VK_SUCCESS;
+		if (j == icd_count)
+			list->properties[list->count++] = wsi_device_extensions[i];
 	}
 
-	max_ext_count += ARRAY_LENGTH(wsi_device_extensions);
+	return list;
 
-	/* Copy ICD extensions and WSI extensions together into the given pointer. */
+error:
+	extension_list_free(list);
+	return NULL;
+}
 
-	/* Calculate the number of extensions we have to copy. */
-	remaining = MIN(*count, max_ext_count);
+static vk_extension_list_t *
+get_device_extensions(vk_physical_device_t *phydev, const char *layer_name)
+{
+	vk_extension_list_t *list;
 
-	/* Copy ICD extensions first. */
-	copied = remaining;
-	result = icd->enum_dev_exts(pdev, layer_name, &copied, extensions);
-	VK_CHECK(result == VK_SUCCESS || result == VK_INCOMPLETE, return VK_ERROR_OUT_OF_HOST_MEMORY,
-			 "vkEnumerateDeviceExtensionProperties() failed.\n");
+	if (!layer_name) {
+		list = __atomic_load_n(&phydev->extensions, __ATOMIC_ACQUIRE);
+		if (list)
+			return list;
+	}
 
-	/* Calculate remaining extensions to copy. */
-	remaining = MIN(remaining - copied, ARRAY_LENGTH(wsi_device_extensions));
+	pthread_mutex_lock(&phydev->mutex);
 
-	/* Copy non duplicate entries */
-	for (i = 0; i < ARRAY_LENGTH(wsi_device_extensions); i++) {
-		for (j = 0; j < copied; j++) {
-			if (strcmp(extensions[j].extensionName,
-					   wsi_device_extensions[i].extensionName) == 0) {
-				max_ext_count--;
-				break;
-			}
+	if (!layer_name) {
+		list = phydev->extensions;
+		if (!list) {
+			list = extension_list_create(phydev, NULL);
+			__atomic_store_n(&phydev->extensions, list, __ATOMIC_RELEASE);
 		}
-		if (j == copied) {
-			if (copy_count < remaining) {
-				memcpy(extensions + copied + copy_count,
-					   &wsi_device_extensions[i], sizeof(VkExtensionProperties));
-				copy_count++;
-			} else {
-				break;
+	} else {
+		if (!phydev->layer_extensions)
+			phydev->layer_extensions = vk_map_string_create(2);
+
+		list = NULL;
+		if (phydev->layer_extensions) {
+			list = vk_map_get(phydev->layer_extensions, layer_name);
+			if (!list) {
+				list = extension_list_create(phydev, layer_name);
+				if (list)
+					vk_map_set(phydev->layer_extensions, layer_name, list, extension_list_free);
 			}
 		}
 	}
-	copied += copy_count;
 
-	/* Return the number of extensions copied. */
-	*count = copied;
+	pthread_mutex_unlock(&phydev->mutex);
+	return list;
+}
+
+void
+vk_physical_device_fini_extensions(vk_physical_device_t *phydev)
+{
+	if (phydev->extensions) {
+		extension_list_free(phydev->extensions);
+		phydev->extensions = NULL;
+	}
+
+	if (phydev->layer_extensions) {
+		vk_map_destroy(phydev->layer_extensions);
+		phydev->layer_extensions = NULL;
+	}
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_EnumerateDeviceExtensionProperties(VkPhysicalDevice		 pdev,
+									  const char			*layer_name,
+									  uint32_t				*count,
+									  VkExtensionProperties	*extensions)
+{
+	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
+	vk_extension_list_t		*list;
+
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_get_physical_device() failed.\n");
+
+	list = get_device_extensions(phydev, layer_name);
+	VK_CHECK(list, return VK_ERROR_OUT_OF_HOST_MEMORY, "get_device_extensions() failed.\n");
+
+	if (!extensions) {
+		*count = list->count;
+		return VK_SUCCESS;
+	}
+
+	*count = MIN(*count, list->count);
+	memcpy(extensions, list->properties, *count * sizeof(VkExtensionProperties));
 
-	if (*count < max_ext_count)
+	if (*count < list->count)
 		return VK_INCOMPLETE;
 
 	return VK_SUCCESS;
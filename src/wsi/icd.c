@@ -24,6 +24,7 @@
 
 #include "wsi.h"
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,16 +36,446 @@ vk_get_icd(void)
 	return &icd;
 }
 
-static vk_physical_device_t dev;
+/* Registries of dispatchable handles, looked up from any thread without locking. Creating and
+ * destroying the objects is serialized by registry_mutex. The maps are created by the module
+ * constructor. */
+static pthread_mutex_t	 registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vk_cmap_t		*instance_map;
+static vk_cmap_t		*device_map;
+static vk_cmap_t		*physical_device_map;
+
+/* Objects are allocated from the allocator given at their creation, falling back to the one of
+ * their parent: instance -> physical device -> device. The chosen allocator is stored in the
+ * object so that WSI objects created later can inherit it. */
+
+/* Must be called with registry_mutex held. */
+static vk_instance_t *
+instance_create(VkInstance instance, const VkAllocationCallbacks *allocator)
+{
+	vk_instance_t *inst;
+
+	allocator = vk_get_allocator(NULL, allocator);
+
+	inst = vk_alloc(allocator, sizeof(vk_instance_t), VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+	VK_CHECK(inst, return NULL, "vk_alloc() failed.\n");
+
+	inst->instance = instance;
+	inst->allocator = *allocator;
+
+	inst->gipa = (PFN_vkGetInstanceProcAddr)icd.get_proc_addr(instance, "vkGetInstanceProcAddr");
+	VK_CHECK(inst->gipa, goto error, "vkGetInstanceProcAddr() not present.\n");
+
+	VK_CHECK(vk_cmap_set(instance_map, (uintptr_t)instance, inst), goto error,
+			 "vk_cmap_set() failed.\n");
+
+	return inst;
+
+error:
+	vk_free(allocator, inst);
+	return NULL;
+}
+
+static void
+instance_destroy(void *object)
+{
+	vk_instance_t			*inst = object;
+	VkAllocationCallbacks	 allocator = inst->allocator;
+
+	vk_free(&allocator, inst);
+}
+
+/* Must be called with registry_mutex held. */
+static vk_physical_device_t *
+physical_device_create(VkPhysicalDevice pdev, vk_instance_t *inst)
+{
+	const VkAllocationCallbacks	*allocator = vk_get_allocator(NULL, NULL);
+	vk_physical_device_t		*phydev;
+
+	if (inst)
+		allocator = &inst->allocator;
+
+	phydev = vk_alloc(allocator, sizeof(vk_physical_device_t),
+					  VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+	VK_CHECK(phydev, return NULL, "vk_alloc() failed.\n");
+
+	memset(phydev, 0x00, sizeof(vk_physical_device_t));
+	phydev->pdev = pdev;
+	phydev->instance = inst;
+	phydev->allocator = allocator;
+	pthread_mutex_init(&phydev->mutex, NULL);
+	pthread_mutex_init(&phydev->tdm_mutex, NULL);
+	pthread_cond_init(&phydev->tdm_cond, NULL);
+
+	if (!vk_cmap_set(physical_device_map, (uintptr_t)pdev, phydev)) {
+		VK_ERROR("vk_cmap_set() failed.\n");
+		pthread_cond_destroy(&phydev->tdm_cond);
+		pthread_mutex_destroy(&phydev->tdm_mutex);
+		pthread_mutex_destroy(&phydev->mutex);
+		vk_free(allocator, phydev);
+		return NULL;
+	}
+
+	if (inst) {
+		phydev->next = inst->physical_devices;
+		inst->physical_devices = phydev;
+	}
+
+	return phydev;
+}
+
+static void
+physical_device_destroy(void *object)
+{
+	vk_physical_device_t *phydev = object;
+
+	if (phydev->display_initialized)
+		vk_physical_device_fini_display(phydev);
+
+	vk_physical_device_fini_extensions(phydev);
+
+	pthread_cond_destroy(&phydev->tdm_cond);
+	pthread_mutex_destroy(&phydev->tdm_mutex);
+	pthread_mutex_destroy(&phydev->mutex);
+	vk_free(phydev->allocator, phydev);
+}
+
+/* Must be called with registry_mutex held. Physical devices go away with their instance, since
+ * they may use its allocator. */
+static void
+instance_remove_physical_devices(vk_instance_t *inst)
+{
+	while (inst->physical_devices) {
+		vk_physical_device_t *phydev = inst->physical_devices;
+
+		inst->physical_devices = phydev->next;
+		vk_cmap_remove(physical_device_map, (uintptr_t)phydev->pdev);
+		physical_device_destroy(phydev);
+	}
+}
+
+/* Must be called with registry_mutex held. */
+static vk_device_t *
+device_create(VkDevice device, const VkAllocationCallbacks *allocator)
+{
+	vk_device_t				*dev;
+	PFN_vkGetDeviceProcAddr	 gdpa;
+
+	allocator = vk_get_allocator(NULL, allocator);
+
+	dev = vk_alloc(allocator, sizeof(vk_device_t), VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+	VK_CHECK(dev, return NULL, "vk_alloc() failed.\n");
+
+	dev->device = device;
+	dev->allocator = *allocator;
+
+	/* Ask the ICD for the most specific GDPA of this device. */
+	gdpa = (PFN_vkGetDeviceProcAddr)icd.get_proc_addr(NULL, "vkGetDeviceProcAddr");
+	VK_CHECK(gdpa, goto error, "vkGetDeviceProcAddr() not present.\n");
+
+	dev->gdpa = (PFN_vkGetDeviceProcAddr)gdpa(device, "vkGetDeviceProcAddr");
+	if (!dev->gdpa)
+		dev->gdpa = gdpa;
+
+	/* Fill the dispatch table. WSI-ICD interface functions fall back to the global ones if the
+	 * ICD does not expose them through GDPA. */
+	dev->destroy_image = (PFN_vkDestroyImage)dev->gdpa(device, "vkDestroyImage");
+	VK_CHECK(dev->destroy_image, goto error, "vkDestroyImage() not present.\n");
+
+	dev->create_presentable_image = (PFN_vkCreateImageFromNativeBufferTIZEN)
+		dev->gdpa(device, "vkCreateImageFromNativeBufferTIZEN");
+	if (!dev->create_presentable_image)
+		dev->create_presentable_image = icd.create_presentable_image;
+
+	dev->queue_signal_release_image = (PFN_vkQueueSignalReleaseImageTIZEN)
+		dev->gdpa(device, "vkQueueSignalReleaseImageTIZEN");
+	if (!dev->queue_signal_release_image)
+		dev->queue_signal_release_image = icd.queue_signal_release_image;
+
+	dev->acquire_image = (PFN_vkAcquireImageTIZEN)dev->gdpa(device, "vkAcquireImageTIZEN");
+	if (!dev->acquire_image)
+		dev->acquire_image = icd.acquire_image;
+
+	VK_CHECK(vk_cmap_set(device_map, (uintptr_t)device, dev), goto error,
+			 "vk_cmap_set() failed.\n");
+
+	return dev;
+
+error:
+	vk_free(allocator, dev);
+	return NULL;
+}
+
+static void
+device_destroy(void *object)
+{
+	vk_device_t				*dev = object;
+	VkAllocationCallbacks	 allocator = dev->allocator;
+
+	vk_free(&allocator, dev);
+}
+
+vk_instance_t *
+vk_get_instance(VkInstance instance)
+{
+	vk_instance_t *inst;
+
+	inst = vk_cmap_get(instance_map, (uintptr_t)instance);
+	if (inst)
+		return inst;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	/* Someone might have registered it while we were waiting for the lock. */
+	inst = vk_cmap_get(instance_map, (uintptr_t)instance);
+	if (!inst)
+		inst = instance_create(instance, NULL);
+
+	pthread_mutex_unlock(&registry_mutex);
+	return inst;
+}
 
 vk_physical_device_t *
 vk_get_physical_device(VkPhysicalDevice pdev)
 {
-	if (dev.pdev != VK_NULL_HANDLE && dev.pdev != pdev)
-		return NULL;
+	vk_physical_device_t *phydev;
+
+	phydev = vk_cmap_get(physical_device_map, (uintptr_t)pdev);
+	if (phydev)
+		return phydev;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	phydev = vk_cmap_get(physical_device_map, (uintptr_t)pdev);
+	if (!phydev)
+		phydev = physical_device_create(pdev, NULL);
+
+	pthread_mutex_unlock(&registry_mutex);
+	return phydev;
+}
 
-	dev.pdev = pdev;
-	return &dev;
+vk_device_t *
+vk_get_device(VkDevice device)
+{
+	vk_device_t *dev;
+
+	dev = vk_cmap_get(device_map, (uintptr_t)device);
+	if (dev)
+		return dev;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	dev = vk_cmap_get(device_map, (uintptr_t)device);
+	if (!dev)
+		dev = device_create(device, NULL);
+
+	pthread_mutex_unlock(&registry_mutex);
+	return dev;
+}
+
+const VkAllocationCallbacks *
+vk_get_parent_allocator(void *parent)
+{
+	vk_device_t				*dev;
+	vk_instance_t			*inst;
+	vk_physical_device_t	*phydev;
+
+	dev = vk_cmap_get(device_map, (uintptr_t)parent);
+	if (dev)
+		return &dev->allocator;
+
+	inst = vk_cmap_get(instance_map, (uintptr_t)parent);
+	if (inst)
+		return &inst->allocator;
+
+	phydev = vk_cmap_get(physical_device_map, (uintptr_t)parent);
+	if (phydev)
+		return phydev->allocator;
+
+	return NULL;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_CreateInstance(const VkInstanceCreateInfo	*info,
+				  const VkAllocationCallbacks	*allocator,
+				  VkInstance					*instance)
+{
+	PFN_vkCreateInstance	 create_instance;
+	PFN_vkDestroyInstance	 destroy_instance;
+	vk_instance_t			*inst;
+	VkResult				 result;
+
+	create_instance = (PFN_vkCreateInstance)icd.gipa(NULL, "vkCreateInstance");
+	VK_CHECK(create_instance, return VK_ERROR_INITIALIZATION_FAILED,
+			 "vkCreateInstance() not present.\n");
+
+	result = create_instance(info, allocator, instance);
+	if (result != VK_SUCCESS)
+		return result;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	/* Drop a stale record left by an instance destroyed behind our back. */
+	inst = vk_cmap_remove(instance_map, (uintptr_t)*instance);
+	if (inst) {
+		instance_remove_physical_devices(inst);
+		instance_destroy(inst);
+	}
+
+	inst = instance_create(*instance, allocator);
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (!inst) {
+		destroy_instance = (PFN_vkDestroyInstance)icd.get_proc_addr(*instance,
+																	"vkDestroyInstance");
+		if (destroy_instance)
+			destroy_instance(*instance, allocator);
+
+		*instance = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
+
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL
+vk_DestroyInstance(VkInstance					 instance,
+				   const VkAllocationCallbacks	*allocator)
+{
+	vk_instance_t			*inst;
+	PFN_vkDestroyInstance	 destroy_instance = NULL;
+
+	if (instance == VK_NULL_HANDLE)
+		return;
+
+	/* Only look the instance up, an unknown one must not be registered just to be dropped. */
+	inst = vk_cmap_get(instance_map, (uintptr_t)instance);
+	if (inst)
+		destroy_instance = (PFN_vkDestroyInstance)inst->gipa(instance, "vkDestroyInstance");
+	else
+		destroy_instance = (PFN_vkDestroyInstance)icd.get_proc_addr(instance,
+																	"vkDestroyInstance");
+
+	pthread_mutex_lock(&registry_mutex);
+
+	inst = vk_cmap_remove(instance_map, (uintptr_t)instance);
+	if (inst)
+		instance_remove_physical_devices(inst);
+
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (inst)
+		instance_destroy(inst);
+
+	VK_CHECK(destroy_instance, return, "vkDestroyInstance() not present.\n");
+	destroy_instance(instance, allocator);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_EnumeratePhysicalDevices(VkInstance			 instance,
+							uint32_t			*count,
+							VkPhysicalDevice	*pdevs)
+{
+	vk_instance_t						*inst = vk_get_instance(instance);
+	PFN_vkEnumeratePhysicalDevices		 enum_pdevs;
+	VkResult							 result;
+	uint32_t							 i;
+
+	VK_CHECK(inst, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_get_instance() failed.\n");
+
+	enum_pdevs = (PFN_vkEnumeratePhysicalDevices)inst->gipa(instance,
+															"vkEnumeratePhysicalDevices");
+	VK_CHECK(enum_pdevs, return VK_ERROR_INITIALIZATION_FAILED,
+			 "vkEnumeratePhysicalDevices() not present.\n");
+
+	result = enum_pdevs(instance, count, pdevs);
+	if (!pdevs || (result != VK_SUCCESS && result != VK_INCOMPLETE))
+		return result;
+
+	/* Register physical devices with their parent instance. */
+	pthread_mutex_lock(&registry_mutex);
+
+	for (i = 0; i < *count; i++) {
+		if (!vk_cmap_get(physical_device_map, (uintptr_t)pdevs[i]))
+			physical_device_create(pdevs[i], inst);
+	}
+
+	pthread_mutex_unlock(&registry_mutex);
+	return result;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_CreateDevice(VkPhysicalDevice				 pdev,
+				const VkDeviceCreateInfo		*info,
+				const VkAllocationCallbacks		*allocator,
+				VkDevice						*device)
+{
+	vk_physical_device_t	*phydev = vk_get_physical_device(pdev);
+	PFN_vkCreateDevice		 create_device;
+	PFN_vkDestroyDevice		 destroy_device;
+	vk_device_t				*dev;
+	VkResult				 result;
+
+	VK_CHECK(phydev, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_get_physical_device() failed.\n");
+
+	if (phydev->instance)
+		create_device = (PFN_vkCreateDevice)phydev->instance->gipa(phydev->instance->instance,
+																   "vkCreateDevice");
+	else
+		create_device = (PFN_vkCreateDevice)icd.get_proc_addr(NULL, "vkCreateDevice");
+	VK_CHECK(create_device, return VK_ERROR_INITIALIZATION_FAILED,
+			 "vkCreateDevice() not present.\n");
+
+	result = create_device(pdev, info, allocator, device);
+	if (result != VK_SUCCESS)
+		return result;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	dev = vk_cmap_remove(device_map, (uintptr_t)*device);
+	if (dev)
+		device_destroy(dev);
+
+	dev = device_create(*device, allocator ? allocator : phydev->allocator);
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (!dev) {
+		destroy_device = (PFN_vkDestroyDevice)icd.get_proc_addr(NULL, "vkDestroyDevice");
+		if (destroy_device)
+			destroy_device(*device, allocator);
+
+		*device = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
+
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL
+vk_DestroyDevice(VkDevice						 device,
+				 const VkAllocationCallbacks	*allocator)
+{
+	vk_device_t			*dev;
+	PFN_vkDestroyDevice	 destroy_device = NULL;
+
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	/* Only look the device up, an unknown one must not be registered just to be dropped. */
+	dev = vk_cmap_get(device_map, (uintptr_t)device);
+	if (dev)
+		destroy_device = (PFN_vkDestroyDevice)dev->gdpa(device, "vkDestroyDevice");
+	else
+		destroy_device = (PFN_vkDestroyDevice)icd.get_proc_addr(NULL, "vkDestroyDevice");
+
+	pthread_mutex_lock(&registry_mutex);
+	dev = vk_cmap_remove(device_map, (uintptr_t)device);
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (dev)
+		device_destroy(dev);
+
+	VK_CHECK(destroy_device, return, "vkDestroyDevice() not present.\n");
+	destroy_device(device, allocator);
 }
 
 static const VkExtensionProperties wsi_instance_extensions[] = {
@@ -60,6 +491,12 @@ module_init(void)
 	VkResult	res;
 	PFN_vkEnumerateInstanceExtensionProperties enum_inst_exts;
 
+	instance_map = vk_cmap_create(2);
+	device_map = vk_cmap_create(2);
+	physical_device_map = vk_cmap_create(2);
+	VK_CHECK(instance_map && device_map && physical_device_map, return,
+			 "vk_cmap_create() failed.\n");
+
 	/* Get env var for ICD path. */
 	filename = getenv("VK_TIZEN_ICD");
 	VK_CHECK(filename, return, "No ICD library given.\n");
@@ -74,6 +511,10 @@ module_init(void)
 	icd.get_proc_addr = dlsym(icd.lib, "vk_icdGetInstanceProcAddr");
 	VK_CHECK(icd.get_proc_addr, return, "vk_icdGetInstanceProcAddr() not present.\n");
 
+	/* GIPA used for global functions, per instance ones are cached in vk_instance_t. */
+	icd.gipa = (void *)icd.get_proc_addr(NULL, "vkGetInstanceProcAddr");
+	VK_CHECK(icd.gipa, return, "vkGetInstanceProcAddr() not present.\n");
+
 	/* Dispatch device extension enumeration function. */
 	icd.enum_dev_exts = (void *)icd.get_proc_addr(NULL, "vkEnumerateDeviceExtensionProperties");
 	VK_CHECK(icd.enum_dev_exts, return, "vkEnumerateDeviceExtensionProperties() not present.\n");
@@ -110,14 +551,22 @@ module_init(void)
 		   ARRAY_LENGTH(wsi_instance_extensions) * sizeof(VkExtensionProperties));
 
 	icd.instance_extension_count = count + ARRAY_LENGTH(wsi_instance_extensions);
-	dev.pdev = VK_NULL_HANDLE;
-	vk_physical_device_init_display(&dev);
 }
 
 static void __attribute__((destructor))
 module_fini(void)
 {
-	vk_physical_device_fini_display(&dev);
+	if (physical_device_map)
+		vk_cmap_destroy(physical_device_map, physical_device_destroy);
+
+	if (device_map)
+		vk_cmap_destroy(device_map, device_destroy);
+
+	if (instance_map)
+		vk_cmap_destroy(instance_map, instance_destroy);
+
+	/* Anything still live at this point has leaked. */
+	vk_alloc_stats_dump();
 
 	if (icd.lib)
 		dlclose(icd.lib);
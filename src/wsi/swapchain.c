@@ -26,6 +26,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #define TBM_FORMAT_0	0
 
@@ -86,11 +88,236 @@ get_tbm_format(VkFormat format, VkCompositeAlphaFlagBitsKHR comp)
 	return 0;
 }
 
-VKAPI_ATTR VkResult VKAPI_CALL
-vk_CreateSwapchainKHR(VkDevice							 device,
-					  const VkSwapchainCreateInfoKHR	*info,
-					  const VkAllocationCallbacks		*allocator,
-					  VkSwapchainKHR					*swapchain)
+/* Allocates from the swapchain arena, falling back to the swapchain allocator once it is used up,
+ * e.g. when the backend hands out more images than requested. Arena memory is released together
+ * with the swapchain. */
+void *
+vk_swapchain_alloc(vk_swapchain_t *chain, size_t size)
+{
+	void *mem;
+
+	if (chain->root)
+		chain = chain->root;
+
+	size = VK_ALLOC_SIZE(size);
+
+	if (chain->arena_size - chain->arena_used < size)
+		return vk_alloc(&chain->allocator, size, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+
+	mem = chain->arena + chain->arena_used;
+	chain->arena_used += size;
+
+	return mem;
+}
+
+void
+vk_swapchain_free(vk_swapchain_t *chain, void *mem)
+{
+	char *ptr = mem;
+
+	if (!mem)
+		return;
+
+	if (chain->root)
+		chain = chain->root;
+
+	if (ptr >= chain->arena && ptr < chain->arena + chain->arena_size)
+		return;
+
+	vk_free(&chain->allocator, mem);
+}
+
+static int
+buffer_index_bucket_bits(uint32_t buffer_count)
+{
+	int bucket_bits = 2;
+
+	/* Keep the table under the map's growth threshold. */
+	while ((1u << bucket_bits) * 3 < buffer_count * 4)
+		bucket_bits++;
+
+	return bucket_bits;
+}
+
+static VkResult
+swapchain_init_buffer_index(vk_swapchain_t *chain)
+{
+	int			 bucket_bits = buffer_index_bucket_bits(chain->buffer_count);
+	void		*buckets;
+	uint32_t	 i;
+
+	buckets = vk_swapchain_alloc(chain, sizeof(vk_map_entry_t) << bucket_bits);
+	VK_CHECK(buckets, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_swapchain_alloc() failed.\n");
+
+	vk_map_int64_init(&chain->buffer_index, bucket_bits, buckets);
+
+	for (i = 0; i < chain->buffer_count; i++) {
+		uint64_t key = (uint64_t)(uintptr_t)chain->buffers[i].tbm;
+
+		vk_map_set(&chain->buffer_index, &key, (void *)(uintptr_t)(i + 1), NULL);
+	}
+
+	return VK_SUCCESS;
+}
+
+/* With VK_TIZEN_ASYNC_IMAGES=1, only the first image is created by vkCreateSwapchainKHR() and the
+ * others are created by the work pool meanwhile. Acquire waits for the image it hands out only,
+ * vkGetSwapchainImagesKHR() for the ones it returns, and once all exist the pool is skipped. An
+ * image which failed to be created is never handed out, its error is returned instead. The ICD
+ * must allow creating images from several threads. */
+typedef struct image_work	image_work_t;
+
+struct image_work {
+	vk_work_t			 work;
+	VkDevice			 device;
+	vk_swapchain_t		*chain;
+	uint32_t			 index;
+	VkImageCreateInfo	 info;
+	VkResult			 result;
+};
+
+static vk_bool_t
+swapchain_async_images(const VkSwapchainCreateInfoKHR *info)
+{
+	const char *env = getenv("VK_TIZEN_ASYNC_IMAGES");
+
+	/* The queue family indices are not kept past vkCreateSwapchainKHR(). */
+	if (info->imageSharingMode != VK_SHARING_MODE_EXCLUSIVE)
+		return VK_FALSE;
+
+	return env && strcmp(env, "0") != 0;
+}
+
+static void
+image_work_func(vk_work_t *work)
+{
+	image_work_t	*image = (image_work_t *)work;
+	vk_swapchain_t	*chain = image->chain;
+
+	VK_TRACE_BEGIN("create_presentable_image");
+	image->result =
+		chain->dev->create_presentable_image(image->device, chain->buffers[image->index].tbm,
+											 &image->info, &chain->allocator,
+											 &chain->buffers[image->index].image);
+	VK_TRACE_END("create_presentable_image");
+
+	if (image->result != VK_SUCCESS)
+		VK_ERROR("create_presentable_image() failed for image %u.\n", image->index);
+}
+
+/* Waits for every image, returns the first creation failure. */
+static VkResult
+swapchain_wait_images(vk_swapchain_t *chain)
+{
+	image_work_t	*works = chain->image_works;
+	uint32_t		 i;
+
+	if (!works || __atomic_load_n(&chain->images_ready, __ATOMIC_ACQUIRE))
+		return VK_SUCCESS;
+
+	vk_work_group_wait(&chain->image_group);
+
+	for (i = 1; i < chain->buffer_count; i++) {
+		if (works[i].result != VK_SUCCESS)
+			return works[i].result;
+	}
+
+	__atomic_store_n(&chain->images_ready, VK_TRUE, __ATOMIC_RELEASE);
+	return VK_SUCCESS;
+}
+
+/* Waits for the image at index only, returns the result of its creation. */
+static VkResult
+swapchain_wait_image(vk_swapchain_t *chain, uint32_t index)
+{
+	image_work_t	*works = chain->image_works;
+	VkResult		 res;
+
+	/* The first image is created by vkCreateSwapchainKHR() itself. */
+	if (!works || index == 0 || __atomic_load_n(&chain->images_ready, __ATOMIC_ACQUIRE))
+		return VK_SUCCESS;
+
+	vk_work_wait(&works[index].work);
+	res = works[index].result;
+
+	if (res == VK_SUCCESS && vk_work_group_done(&chain->image_group))
+		swapchain_wait_images(chain);
+
+	return res;
+}
+
+static vk_bool_t
+swapchain_compatible(vk_swapchain_t *old, const VkSwapchainCreateInfoKHR *info)
+{
+	const VkSwapchainCreateInfoKHR *prev = &old->info;
+
+	/* Shared swapchains commit with their group and keep their own backend. */
+	if (old->retired || old->present_prepare)
+		return VK_FALSE;
+
+	/* Nor are images which failed to be created. */
+	if (swapchain_wait_images(old) != VK_SUCCESS)
+		return VK_FALSE;
+
+	return prev->surface == info->surface &&
+		   prev->minImageCount == info->minImageCount &&
+		   prev->imageFormat == info->imageFormat &&
+		   prev->imageColorSpace == info->imageColorSpace &&
+		   prev->imageExtent.width == info->imageExtent.width &&
+		   prev->imageExtent.height == info->imageExtent.height &&
+		   prev->imageArrayLayers == info->imageArrayLayers &&
+		   prev->imageUsage == info->imageUsage &&
+		   prev->imageSharingMode == info->imageSharingMode &&
+		   prev->preTransform == info->preTransform &&
+		   prev->compositeAlpha == info->compositeAlpha &&
+		   prev->presentMode == info->presentMode &&
+		   prev->clipped == info->clipped;
+}
+
+/* Creates a swapchain taking over the backend, buffers and images of a compatible old one, so
+ * recreating it with the same parameters neither reallocates buffers nor recreates images. The
+ * old swapchain is retired: its acquired images may still be presented, through the same
+ * backend. */
+static VkResult
+swapchain_take_over(vk_swapchain_t					*old,
+					const VkSwapchainCreateInfoKHR	*info,
+					const VkAllocationCallbacks		*allocator,
+					VkSwapchainKHR					*swapchain)
+{
+	vk_swapchain_t *chain;
+
+	chain = vk_alloc(allocator, sizeof(vk_swapchain_t), VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+	VK_CHECK(chain, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
+
+	swapchain_wait_images(old);
+
+	*chain = *old;
+	chain->allocator = *allocator;
+	chain->arena = NULL;
+	chain->arena_size = 0;
+	chain->arena_used = 0;
+	chain->ref_count = 1;
+	chain->timing_read = 0;
+	chain->timing_done = 0;
+	chain->timing_queued = 0;
+	chain->timing_last = 0;
+	pthread_mutex_init(&chain->timing_mutex, NULL);
+	chain->root = old->root ? old->root : old;
+	chain->root->ref_count++;
+
+	old->retired = VK_TRUE;
+
+	*swapchain = (VkSwapchainKHR)(uintptr_t)chain;
+	return VK_SUCCESS;
+}
+
+static VkResult
+swapchain_create(VkDevice							 device,
+				 const VkSwapchainCreateInfoKHR		*info,
+				 const VkAllocationCallbacks		*allocator,
+				 vk_swapchain_tdm_group_t			*group,
+				 uint32_t							 group_index,
+				 VkSwapchainKHR						*swapchain)
 {
 	VkResult (*init)(VkDevice, const VkSwapchainCreateInfoKHR *,
 					 vk_swapchain_t *, tbm_format);
@@ -98,8 +325,11 @@ vk_CreateSwapchainKHR(VkDevice							 device,
 	VkResult			 error;
 	uint32_t			 i;
 	tbm_surface_h		*buffers;
+	size_t				 arena_size;
 	tbm_format			 format;
-	vk_icd_t			*icd = vk_get_icd();
+	vk_device_t			*dev;
+	vk_bool_t			 async_images = swapchain_async_images(info);
+	image_work_t		*works = NULL;
 
 	switch(((VkIcdSurfaceBase *)(uintptr_t)info->surface)->platform) {
 #pragma GCC diagnostic push
@@ -108,26 +338,57 @@ vk_CreateSwapchainKHR(VkDevice							 device,
 #pragma GCC diagnostic pop
 		case VK_ICD_WSI_PLATFORM_WAYLAND:
 			init = swapchain_tpl_init;
+			arena_size = swapchain_tpl_arena_size(info);
 			break;
 		case VK_ICD_WSI_PLATFORM_DISPLAY:
 			init = swapchain_tdm_init;
+			arena_size = swapchain_tdm_arena_size(info);
 			break;
 		default:
 			return VK_ERROR_EXTENSION_NOT_PRESENT;
 	}
 
+	dev = vk_get_device(device);
+	VK_CHECK(dev, return VK_ERROR_INITIALIZATION_FAILED, "vk_get_device() failed.\n");
+
 	allocator = vk_get_allocator(device, allocator);
 
-	chain = vk_alloc(allocator, sizeof(vk_swapchain_t), VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+	if (info->oldSwapchain && !group &&
+		swapchain_compatible((vk_swapchain_t *)(uintptr_t)info->oldSwapchain, info))
+		return swapchain_take_over((vk_swapchain_t *)(uintptr_t)info->oldSwapchain, info,
+								   allocator, swapchain);
+
+	/* Reserve room for the backend data and for the buffers of the requested image count, so
+	 * that the whole swapchain usually lives in a single allocation. */
+	arena_size += VK_ALLOC_SIZE(info->minImageCount * sizeof(vk_buffer_t));
+	arena_size += VK_ALLOC_SIZE(sizeof(vk_map_entry_t) <<
+								buffer_index_bucket_bits(info->minImageCount));
+
+	if (async_images)
+		arena_size += VK_ALLOC_SIZE(info->minImageCount * sizeof(image_work_t));
+
+	chain = vk_alloc(allocator, VK_ALLOC_SIZE(sizeof(vk_swapchain_t)) + arena_size,
+					 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
 	VK_CHECK(chain, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
 
 	memset(chain, 0x00, sizeof(vk_swapchain_t));
 
+	chain->arena = (char *)chain + VK_ALLOC_SIZE(sizeof(vk_swapchain_t));
+	chain->arena_size = arena_size;
 	chain->allocator = *allocator;
 	chain->surface = info->surface;
+	chain->dev = dev;
+	chain->ref_count = 1;
+	pthread_mutex_init(&chain->timing_mutex, NULL);
+
+	chain->info = *info;
+	chain->info.pNext = NULL;
+	chain->info.queueFamilyIndexCount = 0;
+	chain->info.pQueueFamilyIndices = NULL;
+	chain->info.oldSwapchain = VK_NULL_HANDLE;
 
 	format = get_tbm_format(info->imageFormat, info->compositeAlpha);
-	VK_CHECK(format, return VK_ERROR_SURFACE_LOST_KHR, "Not supported image format.\n");
+	VK_CHECK(format, error = VK_ERROR_SURFACE_LOST_KHR; goto done, "Not supported image format.\n");
 
 	error = init(device, info, chain, format);
 	VK_CHECK(error == VK_SUCCESS, goto done, "swapchain backend init failed.\n");
@@ -135,9 +396,12 @@ vk_CreateSwapchainKHR(VkDevice							 device,
 	error = chain->get_buffers(device, chain, &buffers, &chain->buffer_count);
 	VK_CHECK(error == VK_SUCCESS, goto done, "swapchain backend get buffers failed.\n");
 
-	chain->buffers = vk_alloc(&chain->allocator, chain->buffer_count * sizeof(vk_buffer_t),
-							  VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
-	VK_CHECK(chain->buffers, goto error_mem_alloc, "vk_alloc() failed.\n");
+	chain->buffers = vk_swapchain_alloc(chain, chain->buffer_count * sizeof(vk_buffer_t));
+	VK_CHECK(chain->buffers, goto error_mem_alloc, "vk_swapchain_alloc() failed.\n");
+	memset(chain->buffers, 0x00, chain->buffer_count * sizeof(vk_buffer_t));
+
+	if (async_images && chain->buffer_count > 1)
+		works = vk_swapchain_alloc(chain, chain->buffer_count * sizeof(image_work_t));
 
 	for (i = 0; i < chain->buffer_count; i++) {
 		VkImageCreateInfo image_info = {
@@ -159,9 +423,37 @@ vk_CreateSwapchainKHR(VkDevice							 device,
 		};
 
 		chain->buffers[i].tbm = buffers[i];
-		icd->create_presentable_image(device, chain->buffers[i].tbm, &image_info,
-									  &chain->allocator, &chain->buffers[i].image);
+
+		if (works && i > 0) {
+			works[i].work.func = image_work_func;
+			works[i].device = device;
+			works[i].chain = chain;
+			works[i].index = i;
+			works[i].info = image_info;
+			continue;
+		}
+
+		error = dev->create_presentable_image(device, chain->buffers[i].tbm, &image_info,
+											  &chain->allocator, &chain->buffers[i].image);
+		VK_CHECK(error == VK_SUCCESS, goto done, "create_presentable_image() failed.\n");
+	}
+
+	error = swapchain_init_buffer_index(chain);
+	VK_CHECK(error == VK_SUCCESS, goto done, "swapchain_init_buffer_index() failed.\n");
+
+	/* Early acquire signals the image's fence itself, so it needs the ICD to take one. Without
+	 * it, when it is not enabled or cannot be set up, acquire waits for the backend as before. */
+	if (dev->acquire_image)
+		chain->early = vk_early_acquire_create(device, chain);
+
+	if (works) {
+		chain->image_works = works;
+		vk_work_group_init(&chain->image_group);
+
+		for (i = 1; i < chain->buffer_count; i++)
+			vk_work_submit(&chain->image_group, &works[i].work);
 	}
+
 	goto done;
 
 error_mem_alloc:
@@ -169,20 +461,53 @@ error_mem_alloc:
 
 done:
 	if (error != VK_SUCCESS) {
+		/* Images are only created once the buffers are, and none is left to the work pool
+		 * yet on failure. */
+		for (i = 0; chain->buffers && i < chain->buffer_count; i++) {
+			if (chain->buffers[i].image != VK_NULL_HANDLE)
+				dev->destroy_image(device, chain->buffers[i].image, &chain->allocator);
+		}
+
 		if (chain->deinit)
 			chain->deinit(device, chain);
 
-		if (chain)
-			vk_free(allocator, chain);
+		if (chain->buffer_index.entries) {
+			vk_map_fini(&chain->buffer_index);
+			vk_swapchain_free(chain, chain->buffer_index.buckets);
+		}
+
+		vk_swapchain_free(chain, works);
+		vk_swapchain_free(chain, chain->buffers);
+		pthread_mutex_destroy(&chain->timing_mutex);
+		vk_free(allocator, chain);
 
 		*swapchain = VK_NULL_HANDLE;
 	} else {
+		/* Only display swapchains can share their commits. */
+		if (group && init == swapchain_tdm_init)
+			swapchain_tdm_group_join(group, chain, group_index);
+
+		/* The old backend keeps running until the old swapchain is destroyed, so images acquired
+		 * from it can still be presented. Its buffers are not handed over to the new backend,
+		 * both hold their own until the old swapchain goes away. */
+		if (info->oldSwapchain)
+			((vk_swapchain_t *)(uintptr_t)info->oldSwapchain)->retired = VK_TRUE;
+
 		*swapchain = (VkSwapchainKHR)(uintptr_t)chain;
 	}
 
 	return error;
 }
 
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_CreateSwapchainKHR(VkDevice							 device,
+					  const VkSwapchainCreateInfoKHR	*info,
+					  const VkAllocationCallbacks		*allocator,
+					  VkSwapchainKHR					*swapchain)
+{
+	return swapchain_create(device, info, allocator, NULL, 0, swapchain);
+}
+
 VKAPI_ATTR VkResult VKAPI_CALL
 vk_CreateSharedSwapchainsKHR(VkDevice						 device,
 							 uint32_t						 swapchain_count,
@@ -190,8 +515,30 @@ vk_CreateSharedSwapchainsKHR(VkDevice						 device,
 							 const VkAllocationCallbacks	*allocator,
 							 VkSwapchainKHR					*swapchains)
 {
-	/* TODO: */
-	return VK_SUCCESS;
+	vk_swapchain_tdm_group_t	*group;
+	VkResult					 error = VK_SUCCESS;
+	uint32_t					 i;
+
+	/* Swapchains presented together in one vkQueuePresentKHR() are committed together, so
+	 * that their outputs and layers flip on the same frame. */
+	group = swapchain_tdm_group_create(vk_get_allocator(device, allocator), swapchain_count);
+	VK_CHECK(group, return VK_ERROR_OUT_OF_HOST_MEMORY, "swapchain_tdm_group_create() failed.\n");
+
+	for (i = 0; i < swapchain_count; i++) {
+		error = swapchain_create(device, &infos[i], allocator, group, i, &swapchains[i]);
+		if (error != VK_SUCCESS)
+			break;
+	}
+
+	if (error != VK_SUCCESS) {
+		while (i--) {
+			vk_DestroySwapchainKHR(device, swapchains[i], allocator);
+			swapchains[i] = VK_NULL_HANDLE;
+		}
+	}
+
+	swapchain_tdm_group_unref(group);
+	return error;
 }
 
 VKAPI_ATTR void VKAPI_CALL
@@ -199,23 +546,38 @@ vk_DestroySwapchainKHR(VkDevice						 device,
 					   VkSwapchainKHR				 swapchain,
 					   const VkAllocationCallbacks	*allocator)
 {
-	vk_swapchain_t			*chain = (vk_swapchain_t *)(uintptr_t)swapchain;
-	vk_icd_t				*icd = vk_get_icd();
-	PFN_vkGetDeviceProcAddr	 icd_gdpa = (PFN_vkGetDeviceProcAddr)icd->get_proc_addr(NULL, "vkGetDeviceProcAddr");
+	vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)swapchain;
+	vk_swapchain_t	*root = chain->root ? chain->root : chain;
+	uint32_t		 i;
 
-	if (icd_gdpa != VK_NULL_HANDLE) {
-		PFN_vkDestroyImage		 destroy_image = (PFN_vkDestroyImage)icd_gdpa(device, "vkDestroyImage");
-		if (destroy_image != VK_NULL_HANDLE) {
-			uint32_t		 i;
+	/* Swapchains which took over share the backend with the ones they replaced, which may still
+	 * present, so it goes away with the last of them whichever order they are destroyed in. */
+	if (--root->ref_count == 0) {
+		swapchain_wait_images(chain);
 
-			for (i = 0; i < chain->buffer_count; i++)
-				destroy_image(device, chain->buffers[i].image, &chain->allocator);
-		}
+		if (chain->early)
+			vk_early_acquire_destroy(chain->early);
+
+		for (i = 0; i < chain->buffer_count; i++)
+			chain->dev->destroy_image(device, chain->buffers[i].image, &root->allocator);
+
+		chain->deinit(device, chain);
+
+		vk_map_fini(&chain->buffer_index);
+		vk_swapchain_free(chain, chain->buffer_index.buckets);
+		vk_swapchain_free(chain, chain->image_works);
+		vk_swapchain_free(chain, chain->buffers);
+	}
+
+	if (chain != root) {
+		pthread_mutex_destroy(&chain->timing_mutex);
+		vk_free(&chain->allocator, chain);
 	}
 
-	chain->deinit(device, chain);
-	vk_free(&chain->allocator, chain->buffers);
-	vk_free(&chain->allocator, chain);
+	if (root->ref_count == 0) {
+		pthread_mutex_destroy(&root->timing_mutex);
+		vk_free(&root->allocator, root);
+	}
 }
 
 VKAPI_ATTR VkResult VKAPI_CALL
@@ -227,12 +589,18 @@ vk_GetSwapchainImagesKHR(VkDevice		 device,
 	vk_swapchain_t *chain = (vk_swapchain_t *)(uintptr_t)swapchain;
 
 	if (images) {
-		uint32_t i;
+		VkResult	res;
+		uint32_t	i;
 
 		*image_count = MIN(*image_count, chain->buffer_count);
 
-		for (i = 0; i < *image_count; i++)
+		for (i = 0; i < *image_count; i++) {
+			res = swapchain_wait_image(chain, i);
+			if (res != VK_SUCCESS)
+				return res;
+
 			images[i] = chain->buffers[i].image;
+		}
 
 		if (*image_count < chain->buffer_count)
 			return VK_INCOMPLETE;
@@ -243,6 +611,79 @@ vk_GetSwapchainImagesKHR(VkDevice		 device,
 	return VK_SUCCESS;
 }
 
+static VkResult
+acquire_next_image(VkDevice			 device,
+				   VkSwapchainKHR	 swapchain,
+				   uint64_t			 timeout,
+				   VkSemaphore		 semaphore,
+				   VkFence			 fence,
+				   uint32_t			*image_index)
+{
+	VkResult		 res;
+	vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)swapchain;
+	vk_device_t		*dev = chain->dev;
+	tbm_surface_h	 tbm_surface;
+	int				 sync;
+	uint64_t		 key;
+	uintptr_t		 index;
+
+	if (chain->retired)
+		return VK_ERROR_OUT_OF_DATE_KHR;
+
+	if (chain->early) {
+		res = vk_early_acquire_next(chain->early, timeout, image_index, &sync);
+		if (res != VK_SUCCESS)
+			return res;
+
+		/* The swapchain is unusable without the image, the application recreates it. */
+		res = swapchain_wait_image(chain, *image_index);
+		if (res != VK_SUCCESS) {
+			if (sync != -1)
+				close(sync);
+			return res;
+		}
+
+		dev->acquire_image(device, chain->buffers[*image_index].image, sync, semaphore, fence);
+		return VK_SUCCESS;
+	}
+
+	if (dev->acquire_image)
+		res = chain->acquire_image(device, chain, timeout, &tbm_surface, &sync);
+	else
+		res = chain->acquire_image(device, chain, timeout, &tbm_surface, NULL);
+	VK_CHECK(res == VK_SUCCESS, return res, "backend acquire image failed\n.");
+
+	key = (uint64_t)(uintptr_t)tbm_surface;
+	index = (uintptr_t)vk_map_get(&chain->buffer_index, &key);
+
+	/* The backend replaced its buffers, e.g. after a resize. Images are bound to the old ones,
+	 * so the application has to recreate the swapchain. */
+	if (!index) {
+		VK_ERROR("unknown buffer acquired.\n");
+
+		if (dev->acquire_image && sync != -1)
+			close(sync);
+
+		chain->cancel_image(chain, tbm_surface);
+		return VK_ERROR_OUT_OF_DATE_KHR;
+	}
+
+	res = swapchain_wait_image(chain, index - 1);
+	if (res != VK_SUCCESS) {
+		if (dev->acquire_image && sync != -1)
+			close(sync);
+
+		chain->cancel_image(chain, tbm_surface);
+		return res;
+	}
+
+	*image_index = index - 1;
+	if (dev->acquire_image)
+		dev->acquire_image(device, chain->buffers[*image_index].image, sync, semaphore, fence);
+
+	return VK_SUCCESS;
+}
+
 VKAPI_ATTR VkResult VKAPI_CALL
 vk_AcquireNextImageKHR(VkDevice			 device,
 					   VkSwapchainKHR	 swapchain,
@@ -251,58 +692,302 @@ vk_AcquireNextImageKHR(VkDevice			 device,
 					   VkFence			 fence,
 					   uint32_t			*image_index)
 {
-	VkResult		 res;
+	VkResult res;
+
+	VK_TRACE_BEGIN("vkAcquireNextImageKHR");
+	res = acquire_next_image(device, swapchain, timeout, semaphore, fence, image_index);
+	VK_TRACE_END("vkAcquireNextImageKHR");
+
+	return res;
+}
+
+static uint64_t
+get_monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Records a present about to be handed to the backend, which completes it with
+ * vk_swapchain_timing_done() when it reaches the display. The oldest entries are dropped when
+ * the application does not collect them. */
+void
+vk_swapchain_timing_queue(vk_swapchain_t *chain, const VkPresentTimeGOOGLE *time)
+{
+	vk_present_timing_t *timing;
+
+	pthread_mutex_lock(&chain->timing_mutex);
+
+	if (chain->timing_queued - chain->timing_read == VK_PRESENT_TIMING_HISTORY) {
+		if (chain->timing_read == chain->timing_done)
+			chain->timing_done++;
+		chain->timing_read++;
+	}
+
+	timing = &chain->timing[chain->timing_queued++ % VK_PRESENT_TIMING_HISTORY];
+	timing->reported = time != NULL;
+	timing->present_id = time ? time->presentID : 0;
+	timing->desired = time ? time->desiredPresentTime : 0;
+	timing->actual = 0;
+	timing->queued = get_monotonic_time();
+
+	pthread_mutex_unlock(&chain->timing_mutex);
+}
+
+void
+vk_swapchain_timing_done(vk_swapchain_t *chain, uint64_t actual)
+{
+	pthread_mutex_lock(&chain->timing_mutex);
+
+	if (chain->timing_done != chain->timing_queued)
+		chain->timing[chain->timing_done++ % VK_PRESENT_TIMING_HISTORY].actual = actual;
+
+	chain->timing_last = actual;
+
+	pthread_mutex_unlock(&chain->timing_mutex);
+}
+
+/* Forgets the latest present when the backend failed to take it. */
+static void
+swapchain_timing_cancel(vk_swapchain_t *chain)
+{
+	pthread_mutex_lock(&chain->timing_mutex);
+
+	if (chain->timing_queued != chain->timing_done)
+		chain->timing_queued--;
+
+	pthread_mutex_unlock(&chain->timing_mutex);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_GetRefreshCycleDurationGOOGLE(VkDevice						 device,
+								 VkSwapchainKHR					 swapchain,
+								 VkRefreshCycleDurationGOOGLE	*properties)
+{
 	vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)swapchain;
-	vk_icd_t		*icd = vk_get_icd();
-	tbm_surface_h	 tbm_surface;
-	int				 sync;
+	uint64_t		 refresh = chain->get_refresh_duration ?
+							   chain->get_refresh_duration(chain) : 0;
+
+	/* VK_GOOGLE_display_timing is a device extension, so it is exposed for every surface, but
+	 * only TDM knows the refresh rate and the flip times. The compositor behind tpl tells
+	 * neither, so its swapchains report the surface as lost here and never have past timings
+	 * rather than making up a 60Hz display. */
+	if (!refresh)
+		return VK_ERROR_SURFACE_LOST_KHR;
+
+	properties->refreshDuration = refresh;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_GetPastPresentationTimingGOOGLE(VkDevice							 device,
+								   VkSwapchainKHR					 swapchain,
+								   uint32_t							*timing_count,
+								   VkPastPresentationTimingGOOGLE	*timings)
+{
+	vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)swapchain;
+	uint64_t		 refresh = chain->get_refresh_duration ?
+							   chain->get_refresh_duration(chain) : 0;
+	VkResult		 res = VK_SUCCESS;
+	uint32_t		 count = 0;
 	uint32_t		 i;
 
-	if (icd->acquire_image)
-		res = chain->acquire_image(device, chain, timeout, &tbm_surface, &sync);
-	else
-		res = chain->acquire_image(device, chain, timeout, &tbm_surface, NULL);
-	VK_CHECK(res == VK_SUCCESS, return res, "backend acquire image failed\n.");
+	pthread_mutex_lock(&chain->timing_mutex);
 
-	for (i = 0; i < chain->buffer_count; i++) {
-		if (tbm_surface == chain->buffers[i].tbm) {
-			*image_index = i;
-			if (icd->acquire_image)
-				icd->acquire_image(device, chain->buffers[i].image, sync, semaphore, fence);
+	for (i = chain->timing_read; i != chain->timing_done; i++) {
+		vk_present_timing_t				*timing = &chain->timing[i % VK_PRESENT_TIMING_HISTORY];
+		VkPastPresentationTimingGOOGLE	*past;
+		uint64_t						 deadline;
 
-			/* TODO: We can do optimization here by returning buffer index immediatly despite the
-			 * buffer is not released yet. The fence or semaphore will be signaled when
-			 * wl_buffer.release actually arrives. */
+		if (!timing->reported)
+			continue;
 
-			return VK_SUCCESS;
+		if (!timings) {
+			count++;
+			continue;
 		}
+
+		if (count == *timing_count) {
+			res = VK_INCOMPLETE;
+			break;
+		}
+
+		/* Commits flip on the next vblank, so the commit had to be issued within the
+		 * refresh cycle before the flip. */
+		deadline = timing->actual > refresh ? timing->actual - refresh : 0;
+
+		past = &timings[count++];
+		past->presentID = timing->present_id;
+		past->desiredPresentTime = timing->desired;
+		past->actualPresentTime = timing->actual;
+		past->earliestPresentTime = timing->actual;
+		past->presentMargin = deadline > timing->queued ? deadline - timing->queued : 0;
+	}
+
+	/* Returned timings are not reported again. */
+	if (timings)
+		chain->timing_read = i;
+
+	pthread_mutex_unlock(&chain->timing_mutex);
+
+	*timing_count = count;
+	return res;
+}
+
+/* Swapchains presented at once, e.g. to several outputs, are handed to the work pool so that
+ * their fence waits and commits overlap. */
+#define PRESENT_BATCH_SIZE	8
+
+typedef struct present_work	present_work_t;
+
+struct present_work {
+	vk_work_t		 work;
+	VkQueue			 queue;
+	vk_swapchain_t	*chain;
+	uint32_t		 image_index;
+	int				 sync_fd;
+	const VkPresentRegionKHR	*region;
+	const VkPresentTimeGOOGLE	*time;
+	VkResult		 result;
+};
+
+static void
+present_work_func(vk_work_t *work)
+{
+	present_work_t	*present = (present_work_t *)work;
+	vk_swapchain_t	*chain = present->chain;
+	VkResult		 res = VK_SUCCESS;
+
+	if (chain->early)
+		res = vk_early_acquire_wait_dequeued(chain->early, present->image_index);
+
+	if (res == VK_SUCCESS) {
+		if (chain->get_refresh_duration)
+			vk_swapchain_timing_queue(chain, present->time);
+
+		res = chain->present_image(present->queue, chain,
+								   chain->buffers[present->image_index].tbm, present->sync_fd,
+								   present->region,
+								   present->time ? present->time->desiredPresentTime : 0);
+
+		if (chain->get_refresh_duration && res != VK_SUCCESS)
+			swapchain_timing_cancel(chain);
+
+		if (chain->early && res == VK_SUCCESS)
+			vk_early_acquire_presented(chain->early, present->image_index);
+	} else {
+		if (chain->present_skip)
+			chain->present_skip(chain);
+
+		if (present->sync_fd != -1)
+			close(present->sync_fd);
 	}
 
-	return VK_ERROR_SURFACE_LOST_KHR;
+	present->result = res;
 }
 
 VKAPI_ATTR VkResult VKAPI_CALL
 vk_QueuePresentKHR(VkQueue					 queue,
 				   const VkPresentInfoKHR	*info)
 {
-	uint32_t	 i;
-	vk_icd_t	*icd = vk_get_icd();
+	uint32_t		 i, j, count;
+	vk_device_t		*dev = ((vk_swapchain_t *)(uintptr_t)info->pSwapchains[0])->dev;
+	int				 release_fd = -1;
+	present_work_t	 works[PRESENT_BATCH_SIZE];
+	vk_work_group_t	 group;
+	vk_present_context_t	 ctx;
+	const VkPresentRegionsKHR	*regions = NULL;
+	const VkPresentTimesInfoGOOGLE	*times = NULL;
+	const VkPresentRegionsKHR	*next;
+
+	VK_TRACE_BEGIN("vkQueuePresentKHR");
+
+	for (next = info->pNext; next; next = next->pNext) {
+		if (next->sType == VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR)
+			regions = next;
+		else if (next->sType == VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE)
+			times = (const VkPresentTimesInfoGOOGLE *)next;
+	}
+
+	/* All swapchains wait for the same semaphores, so a single release fence is made for the
+	 * whole batch and each backend gets its own duplicate of it. The other images still go
+	 * through the ICD's release step, without semaphores: they are submitted to the same queue
+	 * after the first one, and their own fences are not needed. */
+	if (dev->queue_signal_release_image) {
+		vk_swapchain_t *first = (vk_swapchain_t *)(uintptr_t)info->pSwapchains[0];
+
+		dev->queue_signal_release_image(queue, info->waitSemaphoreCount, info->pWaitSemaphores,
+										first->buffers[info->pImageIndices[0]].image,
+										&release_fd);
+
+		for (i = 1; i < info->swapchainCount; i++) {
+			vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)info->pSwapchains[i];
+			int				 fd = -1;
+
+			dev->queue_signal_release_image(queue, 0, NULL,
+											chain->buffers[info->pImageIndices[i]].image, &fd);
+			if (fd != -1)
+				close(fd);
+		}
+	}
+
+	memset(&ctx, 0x00, sizeof(ctx));
+	ctx.swapchains = info->pSwapchains;
+	ctx.swapchain_count = info->swapchainCount;
+	pthread_mutex_init(&ctx.mutex, NULL);
 
 	for (i = 0; i < info->swapchainCount; i++) {
-		VkResult		 res;
-		int				 sync_fd = -1;
-		vk_swapchain_t	*chain = (vk_swapchain_t *)(uintptr_t)info->pSwapchains[i];
+		vk_swapchain_t *chain = (vk_swapchain_t *)(uintptr_t)info->pSwapchains[i];
 
-		if (icd->queue_signal_release_image)
-			icd->queue_signal_release_image(queue, info->waitSemaphoreCount, info->pWaitSemaphores,
-											chain->buffers[info->pImageIndices[i]].image, &sync_fd);
+		if (chain->present_prepare)
+			chain->present_prepare(chain, &ctx);
+	}
 
-		res = chain->present_image(queue, chain,
-								   chain->buffers[info->pImageIndices[i]].tbm, sync_fd);
+	for (i = 0; i < info->swapchainCount; i += count) {
+		count = MIN(info->swapchainCount - i, PRESENT_BATCH_SIZE);
+		vk_work_group_init(&group);
+
+		for (j = 0; j < count; j++) {
+			present_work_t *present = &works[j];
+
+			present->work.func = present_work_func;
+			present->queue = queue;
+			present->chain = (vk_swapchain_t *)(uintptr_t)info->pSwapchains[i + j];
+			present->image_index = info->pImageIndices[i + j];
+			present->sync_fd = release_fd;
+			present->region = regions && regions->pRegions ? &regions->pRegions[i + j] : NULL;
+			present->time = times && times->pTimes ? &times->pTimes[i + j] : NULL;
+
+			/* The last backend takes the original. */
+			if (release_fd != -1 && i + j + 1 < info->swapchainCount) {
+				present->sync_fd = dup(release_fd);
+
+				/* Without a fence of its own, this backend must not see the buffer before
+				 * rendering has finished. */
+				if (present->sync_fd == -1) {
+					VK_ERROR("dup() failed: %d\n", errno);
+					tbm_sync_fence_wait(release_fd, -1);
+				}
+			}
+
+			/* The first one is presented by this thread. */
+			if (j > 0)
+				vk_work_submit(&group, &present->work);
+		}
 
-		if (info->pResults != NULL)
-			info->pResults[i] = res;
+		present_work_func(&works[0].work);
+		vk_work_group_wait(&group);
+
+		if (info->pResults != NULL) {
+			for (j = 0; j < count; j++)
+				info->pResults[i + j] = works[j].result;
+		}
 	}
 
+	pthread_mutex_destroy(&ctx.mutex);
+
+	VK_TRACE_END("vkQueuePresentKHR");
 	return VK_SUCCESS;
 }
@@ -0,0 +1,505 @@
+/*
+ * Copyright © 2016 S-Core Corporation
+ * Copyright © 2016-2017 Samsung Electronics co., Ltd. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "wsi.h"
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+/* Early acquire, enabled with VK_TIZEN_EARLY_ACQUIRE=1.
+ *
+ * Instead of blocking vkAcquireNextImageKHR() until the backend releases a buffer, a worker
+ * thread dequeues buffers from the backend, and acquire may hand out the image that is expected
+ * to be released next together with a fence that the worker signals once it is. The GPU then
+ * waits on the semaphore instead of the render thread waiting on the CPU.
+ *
+ * The prediction is the least recently presented image, since compositors and displays release
+ * buffers in presentation order. The most recently presented image is never predicted: it stays
+ * on screen until a later present replaces it, so rendering to it would wait for itself. The
+ * worker also dequeues ahead while the backend holds images that were never presented, and
+ * acquire waits for the worker when there is nothing safe to predict. If the backend releases
+ * another buffer first, the worker keeps it as free and the next acquire hands it out directly.
+ * Each image owns a tbm sync timeline; a predicted image is given a fence on the next point of
+ * its timeline, which the worker advances after dequeuing the buffer and waiting for the
+ * backend's release fence. On errors and on destruction, fences still pending are signalled so
+ * that the GPU never waits for them forever.
+ *
+ * The worker is started when an acquire needs it and exits once it had nothing to do for
+ * EARLY_ACQUIRE_IDLE_TIMEOUT, or on the first backend error, so idle swapchains have no thread.
+ *
+ * Image states:
+ *   BACKEND	owned by the backend, never presented by this swapchain
+ *   PRESENTED	owned by the backend after a present, candidate for prediction
+ *   PREDICTED	handed to the application, not dequeued from the backend yet
+ *   FREE		dequeued by the worker, not handed out yet
+ *   ACQUIRED	dequeued and handed to the application
+ */
+#define EARLY_ACQUIRE_POLL_TIMEOUT		100000000ull	/* ns */
+#define EARLY_ACQUIRE_IDLE_TIMEOUT		1000000000ull	/* ns */
+#define EARLY_ACQUIRE_SLOW_RELEASE		2000000000ull	/* ns */
+
+typedef enum early_image_state	early_image_state_t;
+typedef struct early_image		early_image_t;
+
+enum early_image_state {
+	EARLY_IMAGE_BACKEND,
+	EARLY_IMAGE_PRESENTED,
+	EARLY_IMAGE_PREDICTED,
+	EARLY_IMAGE_FREE,
+	EARLY_IMAGE_ACQUIRED,
+};
+
+struct early_image {
+	early_image_state_t	 state;
+	uint64_t			 present_seq;
+	tbm_fd				 timeline;
+	uint32_t			 point;
+	int					 sync;		/* Backend release fence of a FREE image. */
+};
+
+struct vk_early_acquire {
+	vk_swapchain_t		*chain;
+	VkDevice			 device;
+
+	pthread_t			 thread;
+	vk_bool_t			 running;	/* The worker is in its loop. */
+	vk_bool_t			 joinable;	/* thread was started and not joined yet. */
+	pthread_mutex_t		 mutex;
+	pthread_cond_t		 cond;		/* On CLOCK_MONOTONIC. */
+	vk_bool_t			 stop;
+	uint32_t			 waiters;
+	VkResult			 error;
+
+	uint64_t			 present_seq;
+	early_image_t		*images;
+};
+
+/* Deadline for pthread_cond_timedwait() on early->cond. */
+static void
+abs_timeout(struct timespec *ts, uint64_t timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	ts->tv_sec += timeout / 1000000000ull;
+	ts->tv_nsec += timeout % 1000000000ull;
+
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static vk_bool_t
+early_worker_needed(vk_early_acquire_t *early)
+{
+	vk_bool_t	free = VK_FALSE;
+	vk_bool_t	backend = VK_FALSE;
+	uint32_t	i;
+
+	for (i = 0; i < early->chain->buffer_count; i++) {
+		if (early->images[i].state == EARLY_IMAGE_PREDICTED)
+			return VK_TRUE;
+
+		if (early->images[i].state == EARLY_IMAGE_FREE)
+			free = VK_TRUE;
+		else if (early->images[i].state == EARLY_IMAGE_BACKEND)
+			backend = VK_TRUE;
+	}
+
+	/* Keep one buffer dequeued ahead while the backend has some it never displayed. */
+	return !free && (early->waiters > 0 || backend);
+}
+
+static void
+early_signal(early_image_t *image, int sync)
+{
+	if (sync != -1) {
+		if (tbm_sync_fence_wait(sync, -1) != 1)
+			VK_ERROR("tbm_sync_fence_wait() failed: %d\n", errno);
+
+		close(sync);
+	}
+
+	if (tbm_sync_timeline_inc(image->timeline, 1) == 0)
+		VK_ERROR("tbm_sync_timeline_inc() failed: %d\n", errno);
+}
+
+/* Signals the fences of predicted images which will not be dequeued anymore and gives them back
+ * to the backend state. Must be called with the mutex held. */
+static void
+early_cancel_predicted(vk_early_acquire_t *early)
+{
+	uint32_t i;
+
+	for (i = 0; i < early->chain->buffer_count; i++) {
+		early_image_t *image = &early->images[i];
+
+		if (image->state != EARLY_IMAGE_PREDICTED)
+			continue;
+
+		if (tbm_sync_timeline_inc(image->timeline, 1) == 0)
+			VK_ERROR("tbm_sync_timeline_inc() failed: %d\n", errno);
+
+		image->state = EARLY_IMAGE_BACKEND;
+	}
+}
+
+/* Must be called with the mutex held. */
+static void
+early_fail(vk_early_acquire_t *early, VkResult error)
+{
+	if (early->error == VK_SUCCESS)
+		early->error = error;
+
+	early_cancel_predicted(early);
+	pthread_cond_broadcast(&early->cond);
+}
+
+static void *
+early_worker_main(void *data)
+{
+	vk_early_acquire_t	*early = data;
+	vk_swapchain_t		*chain = early->chain;
+
+	pthread_mutex_lock(&early->mutex);
+
+	while (!early->stop && early->error == VK_SUCCESS) {
+		tbm_surface_h	 tbm_surface;
+		early_image_t	*image;
+		int				 sync = -1;
+		uint64_t		 key;
+		uintptr_t		 index;
+		VkResult		 res;
+		struct timespec	 deadline;
+
+		if (!early_worker_needed(early)) {
+			abs_timeout(&deadline, EARLY_ACQUIRE_IDLE_TIMEOUT);
+
+			if (pthread_cond_timedwait(&early->cond, &early->mutex, &deadline) == ETIMEDOUT &&
+				!early_worker_needed(early))
+				break;
+
+			continue;
+		}
+
+		pthread_mutex_unlock(&early->mutex);
+
+		VK_TRACE_BEGIN("early_acquire_dequeue");
+		res = chain->acquire_image(early->device, chain, EARLY_ACQUIRE_POLL_TIMEOUT,
+								   &tbm_surface, &sync);
+		VK_TRACE_END("early_acquire_dequeue");
+
+		if (res == VK_TIMEOUT) {
+			pthread_mutex_lock(&early->mutex);
+			continue;
+		}
+
+		if (res == VK_SUCCESS) {
+			key = (uint64_t)(uintptr_t)tbm_surface;
+			index = (uintptr_t)vk_map_get(&chain->buffer_index, &key);
+			if (!index) {
+				chain->cancel_image(chain, tbm_surface);
+				res = VK_ERROR_OUT_OF_DATE_KHR;
+			}
+		}
+
+		if (res != VK_SUCCESS) {
+			if (sync != -1)
+				close(sync);
+
+			/* Not retried, the swapchain is unusable from here on. */
+			pthread_mutex_lock(&early->mutex);
+			early_fail(early, res);
+			break;
+		}
+
+		image = &early->images[index - 1];
+
+		pthread_mutex_lock(&early->mutex);
+
+		if (image->state == EARLY_IMAGE_PREDICTED) {
+			/* The application already has it, release its fence. The state changes first so
+			 * that early_fail() does not signal the fence a second time. */
+			image->state = EARLY_IMAGE_ACQUIRED;
+
+			pthread_mutex_unlock(&early->mutex);
+			early_signal(image, sync);
+			pthread_mutex_lock(&early->mutex);
+		} else {
+			image->state = EARLY_IMAGE_FREE;
+			image->sync = sync;
+		}
+
+		pthread_cond_broadcast(&early->cond);
+	}
+
+	/* early_worker_start() joins the thread before starting another one. */
+	early->running = VK_FALSE;
+
+	pthread_mutex_unlock(&early->mutex);
+	return NULL;
+}
+
+/* Starts the worker if it is needed and not running. Must be called with the mutex held. */
+static void
+early_worker_start(vk_early_acquire_t *early)
+{
+	if (early->running || early->stop || early->error != VK_SUCCESS ||
+		!early_worker_needed(early))
+		return;
+
+	/* A worker which went idle released the mutex for the last time already. */
+	if (early->joinable)
+		pthread_join(early->thread, NULL);
+
+	early->joinable = VK_FALSE;
+
+	if (pthread_create(&early->thread, NULL, early_worker_main, early)) {
+		VK_ERROR("pthread_create() failed.\n");
+		early_fail(early, VK_ERROR_OUT_OF_HOST_MEMORY);
+		return;
+	}
+
+	early->running = VK_TRUE;
+	early->joinable = VK_TRUE;
+}
+
+static void
+early_acquire_free(vk_early_acquire_t *early)
+{
+	uint32_t i;
+
+	for (i = 0; early->images && i < early->chain->buffer_count; i++) {
+		if (early->images[i].timeline != -1)
+			close(early->images[i].timeline);
+
+		if (early->images[i].sync != -1)
+			close(early->images[i].sync);
+	}
+
+	pthread_cond_destroy(&early->cond);
+	pthread_mutex_destroy(&early->mutex);
+	vk_swapchain_free(early->chain, early->images);
+	vk_swapchain_free(early->chain, early);
+}
+
+vk_early_acquire_t *
+vk_early_acquire_create(VkDevice device, vk_swapchain_t *chain)
+{
+	vk_early_acquire_t	*early;
+	const char			*env = getenv("VK_TIZEN_EARLY_ACQUIRE");
+	pthread_condattr_t	 attr;
+	uint32_t			 i;
+
+	if (!env || strcmp(env, "0") == 0)
+		return NULL;
+
+	early = vk_swapchain_alloc(chain, sizeof(vk_early_acquire_t));
+	VK_CHECK(early, return NULL, "vk_swapchain_alloc() failed.\n");
+
+	memset(early, 0x00, sizeof(vk_early_acquire_t));
+	early->chain = chain;
+	early->device = device;
+	pthread_mutex_init(&early->mutex, NULL);
+
+	/* Deadlines must not move with the wall clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&early->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	early->images = vk_swapchain_alloc(chain, chain->buffer_count * sizeof(early_image_t));
+	VK_CHECK(early->images, goto error, "vk_swapchain_alloc() failed.\n");
+
+	for (i = 0; i < chain->buffer_count; i++) {
+		early->images[i].state = EARLY_IMAGE_BACKEND;
+		early->images[i].sync = -1;
+		early->images[i].timeline = -1;
+	}
+
+	for (i = 0; i < chain->buffer_count; i++) {
+		early->images[i].timeline = tbm_sync_timeline_create();
+		VK_CHECK(early->images[i].timeline != -1, goto error,
+				 "tbm_sync_timeline_create() failed.\n");
+	}
+
+	return early;
+
+error:
+	early_acquire_free(early);
+	return NULL;
+}
+
+void
+vk_early_acquire_destroy(vk_early_acquire_t *early)
+{
+	pthread_mutex_lock(&early->mutex);
+	early->stop = VK_TRUE;
+	pthread_cond_broadcast(&early->cond);
+	pthread_mutex_unlock(&early->mutex);
+
+	/* No worker is started once stop is set. */
+	if (early->joinable)
+		pthread_join(early->thread, NULL);
+
+	pthread_mutex_lock(&early->mutex);
+	early_cancel_predicted(early);
+	pthread_mutex_unlock(&early->mutex);
+
+	early_acquire_free(early);
+}
+
+VkResult
+vk_early_acquire_next(vk_early_acquire_t	*early,
+					  uint64_t				 timeout,
+					  uint32_t				*image_index,
+					  int					*sync)
+{
+	struct timespec		 deadline;
+	VkResult			 res = VK_SUCCESS;
+	uint32_t			 count = early->chain->buffer_count;
+
+	if (timeout != UINT64_MAX)
+		abs_timeout(&deadline, timeout);
+
+	pthread_mutex_lock(&early->mutex);
+
+	for (;;) {
+		early_image_t	*oldest = NULL;
+		uint32_t		 i;
+
+		if (early->error != VK_SUCCESS) {
+			res = early->error;
+			break;
+		}
+
+		/* A buffer released already. */
+		for (i = 0; i < count; i++) {
+			if (early->images[i].state == EARLY_IMAGE_FREE)
+				break;
+		}
+
+		if (i < count) {
+			early->images[i].state = EARLY_IMAGE_ACQUIRED;
+			*sync = early->images[i].sync;
+			early->images[i].sync = -1;
+			*image_index = i;
+			break;
+		}
+
+		/* Predict the least recently presented one, but never the one presented last. */
+		for (i = 0; i < count; i++) {
+			early_image_t *image = &early->images[i];
+
+			if (image->state == EARLY_IMAGE_PRESENTED &&
+				image->present_seq != early->present_seq &&
+				(!oldest || image->present_seq < oldest->present_seq))
+				oldest = image;
+		}
+
+		if (oldest) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "vk_early_acquire_%u", (uint32_t)(oldest - early->images));
+			*sync = tbm_sync_fence_create(oldest->timeline, name, ++oldest->point);
+			VK_CHECK(*sync != -1, res = VK_ERROR_OUT_OF_HOST_MEMORY; break,
+					 "tbm_sync_fence_create() failed.\n");
+
+			oldest->state = EARLY_IMAGE_PREDICTED;
+			*image_index = oldest - early->images;
+			early_worker_start(early);
+			pthread_cond_broadcast(&early->cond);
+			break;
+		}
+
+		/* Nothing safe to predict, wait for the worker to dequeue a buffer. */
+		if (timeout == 0) {
+			res = VK_NOT_READY;
+			break;
+		}
+
+		early->waiters++;
+		early_worker_start(early);
+		pthread_cond_broadcast(&early->cond);
+
+		if (timeout == UINT64_MAX) {
+			pthread_cond_wait(&early->cond, &early->mutex);
+		} else if (pthread_cond_timedwait(&early->cond, &early->mutex,
+										  &deadline) == ETIMEDOUT) {
+			res = VK_TIMEOUT;
+		}
+
+		early->waiters--;
+
+		if (res != VK_SUCCESS)
+			break;
+	}
+
+	pthread_mutex_unlock(&early->mutex);
+	return res;
+}
+
+VkResult
+vk_early_acquire_wait_dequeued(vk_early_acquire_t *early, uint32_t image_index)
+{
+	struct timespec	 deadline;
+	VkResult		 res;
+	vk_bool_t		 warned = VK_FALSE;
+
+	abs_timeout(&deadline, EARLY_ACQUIRE_SLOW_RELEASE);
+
+	pthread_mutex_lock(&early->mutex);
+
+	/* The backend cannot take back a buffer it still owns and the application rendered to it
+	 * already, so the present waits for the worker however long the release takes. Only a
+	 * backend error ends the wait. */
+	while (early->images[image_index].state == EARLY_IMAGE_PREDICTED &&
+		   early->error == VK_SUCCESS) {
+		if (warned) {
+			pthread_cond_wait(&early->cond, &early->mutex);
+		} else if (pthread_cond_timedwait(&early->cond, &early->mutex,
+										  &deadline) == ETIMEDOUT) {
+			VK_WARN("predicted image %u is slow to be released by the backend.\n", image_index);
+			warned = VK_TRUE;
+		}
+	}
+
+	res = early->images[image_index].state == EARLY_IMAGE_ACQUIRED ? VK_SUCCESS : early->error;
+
+	pthread_mutex_unlock(&early->mutex);
+	return res;
+}
+
+void
+vk_early_acquire_presented(vk_early_acquire_t *early, uint32_t image_index)
+{
+	pthread_mutex_lock(&early->mutex);
+
+	early->images[image_index].state = EARLY_IMAGE_PRESENTED;
+	early->images[image_index].present_seq = ++early->present_seq;
+
+	pthread_mutex_unlock(&early->mutex);
+}
@@ -28,10 +28,15 @@
 #include <unistd.h>
 #include <stdio.h>
 
+/* Longest a present is held back for VK_GOOGLE_display_timing. */
+#define SWAPCHAIN_TDM_MAX_PRESENT_DELAY	100000000ull	/* ns */
+
 typedef struct vk_swapchain_tdm vk_swapchain_tdm_t;
 
 struct vk_swapchain_tdm {
 	tdm_display				*tdm_display;
+	vk_physical_device_t	*pdev;			/* Owns tdm_display and tdm_mutex. */
+	vk_bool_t				 commit_pending;	/* Protected by pdev->tdm_mutex. */
 	tdm_output				*tdm_output;
 	tdm_layer				*tdm_layer;
 	const tdm_output_mode	*tdm_mode;
@@ -45,6 +50,25 @@ struct vk_swapchain_tdm {
 	pthread_mutex_t			 front_mutex;
 	pthread_mutex_t			 free_queue_mutex;
 	pthread_cond_t			 free_queue_cond;
+
+	/* Swapchains created by vkCreateSharedSwapchainsKHR() commit as a group. */
+	vk_swapchain_tdm_group_t	*group;
+	vk_present_context_t		*present_ctx;	/* Of the present the swapchain is in. */
+	tbm_surface_h				 staged;		/* Buffer waiting for the group commit. */
+};
+
+/* Group members presented in the same vkQueuePresentKHR() call stage their buffers on their
+ * layers, and the last one to do so commits every output involved at once. The counts live in
+ * the call's vk_present_context_t, so presents of other members from other threads are
+ * committed on their own. Members never wait for each other, so they may be presented from the
+ * work pool in any order. */
+struct vk_swapchain_tdm_group {
+	VkAllocationCallbacks	 allocator;
+	pthread_mutex_t			 mutex;
+	uint32_t				 ref_count;
+
+	uint32_t				 member_count;
+	vk_swapchain_t			*members[];
 };
 
 static int swapchain_tdm_timeline_key;
@@ -67,6 +91,34 @@ swapchain_tdm_increase_timestamp(tbm_surface_h tbm_surface)
 	}
 }
 
+/* TDM hands the commit handler the timestamp of the flip event from its backend without naming
+ * the clock. DRM based backends forward the page flip event, which is CLOCK_MONOTONIC unless
+ * the kernel runs with drm.timestamp_monotonic=0 (DRM_CAP_TIMESTAMP_MONOTONIC). Anything far off
+ * the monotonic clock is taken as CLOCK_REALTIME and converted by sampling both clocks. */
+static uint64_t
+swapchain_tdm_flip_time(unsigned int tv_sec, unsigned int tv_usec)
+{
+	const uint64_t	 tolerance = 10000000000ull;
+	uint64_t		 flip = (uint64_t)tv_sec * 1000000000ull + tv_usec * 1000ull;
+	uint64_t		 mono, real;
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	if (flip <= mono && mono - flip < tolerance)
+		return flip;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	real = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	if (flip <= real && real - flip < tolerance && real - flip < mono)
+		return mono - (real - flip);
+
+	/* No idea, the handler runs right after the flip anyway. */
+	return mono;
+}
+
 static void
 swapchain_tdm_output_commit_cb(tdm_output *output, unsigned int sequence,
 							   unsigned int tv_sec, unsigned int tv_usec,
@@ -75,6 +127,11 @@ swapchain_tdm_output_commit_cb(tdm_output *output, unsigned int sequence,
 	vk_swapchain_t			*chain = user_data;
 	vk_swapchain_tdm_t		*swapchain_tdm = chain->backend_data;
 
+	VK_TRACE_INSTANT("swapchain_tdm_output_commit_cb");
+
+	swapchain_tdm->commit_pending = VK_FALSE;
+	vk_swapchain_timing_done(chain, swapchain_tdm_flip_time(tv_sec, tv_usec));
+
 	if (pthread_mutex_lock(&swapchain_tdm->front_mutex))
 		VK_ERROR("pthread_mutex_lock front buffer failed\n");
 
@@ -85,18 +142,87 @@ swapchain_tdm_output_commit_cb(tdm_output *output, unsigned int sequence,
 	pthread_mutex_unlock(&swapchain_tdm->front_mutex);
 }
 
+static uint64_t
+swapchain_tdm_get_refresh_duration(vk_swapchain_t *chain)
+{
+	vk_swapchain_tdm_t		*swapchain_tdm = chain->backend_data;
+	const tdm_output_mode	*mode = swapchain_tdm->tdm_mode;
+
+	/* The pixel clock is in kHz. */
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return (uint64_t)mode->htotal * mode->vtotal * 1000000ull / mode->clock;
+
+	if (mode->vrefresh)
+		return 1000000000ull / mode->vrefresh;
+
+	/* Unknown, do not make one up. */
+	return 0;
+}
+
+/* Holds the commit back so that the flip does not happen before the desired present time. A
+ * commit flips on the next vblank, so it is issued once the vblank preceding the desired time
+ * has passed, predicted from the latest flip. The wait blocks the presenting thread, which may
+ * be the application's, so it never exceeds SWAPCHAIN_TDM_MAX_PRESENT_DELAY. */
+static void
+swapchain_tdm_wait_desired_time(vk_swapchain_t *chain, uint64_t desired)
+{
+	uint64_t		 refresh, last, target, now;
+	struct timespec	 ts;
+
+	if (!desired)
+		return;
+
+	refresh = swapchain_tdm_get_refresh_duration(chain);
+	if (!refresh)
+		return;
+
+	pthread_mutex_lock(&chain->timing_mutex);
+	last = chain->timing_last;
+	pthread_mutex_unlock(&chain->timing_mutex);
+
+	if (last && last < desired)
+		target = last + (desired - last - 1) / refresh * refresh;
+	else
+		target = desired > refresh / 2 ? desired - refresh / 2 : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	if (now >= target)
+		return;
+
+	if (target - now > SWAPCHAIN_TDM_MAX_PRESENT_DELAY)
+		target = now + SWAPCHAIN_TDM_MAX_PRESENT_DELAY;
+
+	ts.tv_sec = target / 1000000000ull;
+	ts.tv_nsec = target % 1000000000ull;
+
+	VK_TRACE_BEGIN("swapchain_tdm_wait_desired_time");
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	VK_TRACE_END("swapchain_tdm_wait_desired_time");
+}
+
+/* Waits for rendering and puts the buffer on the layer. The layer shows it on the next commit
+ * of its output. */
 static VkResult
-swapchain_tdm_queue_present_image(VkQueue					 queue,
-								  vk_swapchain_t			*chain,
-								  tbm_surface_h				 tbm_surface,
-								  int						 sync_fd)
+swapchain_tdm_stage_image(vk_swapchain_t	*chain,
+						  tbm_surface_h		 tbm_surface,
+						  int				 sync_fd,
+						  uint64_t			 desired_time,
+						  tbm_surface_h		*staged)
 {
 	tbm_surface_queue_error_e	 tsq_err;
 	tdm_error					 tdm_err;
 	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
 
 	if (sync_fd != -1) {
-		if (tbm_sync_fence_wait(sync_fd, -1) != 1) {
+		int ret;
+
+		VK_TRACE_BEGIN("tbm_sync_fence_wait");
+		ret = tbm_sync_fence_wait(sync_fd, -1);
+		VK_TRACE_END("tbm_sync_fence_wait");
+
+		if (ret != 1) {
 			char buf[1024];
 			strerror_r(errno, buf, sizeof(buf));
 			VK_ERROR("Failed to wait sync. | error: %d(%s)", errno, buf);
@@ -104,26 +230,31 @@ swapchain_tdm_queue_present_image(VkQueue					 queue,
 		close(sync_fd);
 	}
 
+	swapchain_tdm_wait_desired_time(chain, desired_time);
+
+	VK_TRACE_BEGIN("tbm_surface_queue_enqueue");
 	tsq_err = tbm_surface_queue_enqueue(swapchain_tdm->tbm_queue, tbm_surface);
+	VK_TRACE_END("tbm_surface_queue_enqueue");
 	VK_CHECK(tsq_err == TBM_SURFACE_QUEUE_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
 			 "tbm_surface_queue_enqueue failed.\n");
 
-	tsq_err = tbm_surface_queue_acquire(swapchain_tdm->tbm_queue, &tbm_surface);
+	tsq_err = tbm_surface_queue_acquire(swapchain_tdm->tbm_queue, staged);
 	VK_CHECK(tsq_err == TBM_SURFACE_QUEUE_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
 			 "tbm_surface_queue_acquire failed.\n");
 
-	tdm_err = tdm_layer_set_buffer(swapchain_tdm->tdm_layer, tbm_surface);
+	tdm_err = tdm_layer_set_buffer(swapchain_tdm->tdm_layer, *staged);
 	VK_CHECK(tdm_err == TDM_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
 			 "tdm_layer_set_buffer failed.\n");
 
-	tdm_err = tdm_output_commit(swapchain_tdm->tdm_output, 0,
-								swapchain_tdm_output_commit_cb, chain);
-	VK_CHECK(tdm_err == TDM_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
-			 "tdm_output_commit failed.\n");
+	return VK_SUCCESS;
+}
 
-	tdm_err = tdm_display_handle_events(swapchain_tdm->tdm_display);
-	VK_CHECK(tdm_err == TDM_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
-			 "tdm_display_handle_events failed.\n");
+/* Hands a committed buffer back to the queue and makes it the front buffer. */
+static VkResult
+swapchain_tdm_finish_image(vk_swapchain_t *chain, tbm_surface_h tbm_surface)
+{
+	tbm_surface_queue_error_e	 tsq_err;
+	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
 
 	if (pthread_mutex_lock(&swapchain_tdm->free_queue_mutex))
 		VK_ERROR("pthread_mutex_lock free queue failed\n");
@@ -145,6 +276,322 @@ swapchain_tdm_queue_present_image(VkQueue					 queue,
 	return VK_SUCCESS;
 }
 
+/* Waits until the commit callback of the swapchain ran, which another thread dispatching events
+ * may run instead. Called with tdm_mutex held. */
+static VkResult
+swapchain_tdm_wait_commit(vk_swapchain_tdm_t *swapchain_tdm)
+{
+	return vk_physical_device_wait_tdm_commit(swapchain_tdm->pdev,
+											  &swapchain_tdm->commit_pending);
+}
+
+static VkResult
+swapchain_tdm_queue_present_image(VkQueue					 queue,
+								  vk_swapchain_t			*chain,
+								  tbm_surface_h				 tbm_surface,
+								  int						 sync_fd,
+								  const VkPresentRegionKHR	*region,
+								  uint64_t					 desired_time)
+{
+	VkResult					 res;
+	tdm_error					 tdm_err;
+	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
+
+	res = swapchain_tdm_stage_image(chain, tbm_surface, sync_fd, desired_time, &tbm_surface);
+	if (res != VK_SUCCESS)
+		return res;
+
+	/* Swapchains on the same display may be presented from several threads. tdm_mutex is
+	 * released while waiting for the flip, so the other outputs commit for the same vblank. */
+	pthread_mutex_lock(&swapchain_tdm->pdev->tdm_mutex);
+
+	swapchain_tdm->commit_pending = VK_TRUE;
+
+	VK_TRACE_BEGIN("tdm_output_commit");
+	tdm_err = tdm_output_commit(swapchain_tdm->tdm_output, 0,
+								swapchain_tdm_output_commit_cb, chain);
+	VK_TRACE_END("tdm_output_commit");
+
+	if (tdm_err != TDM_ERROR_NONE) {
+		VK_ERROR("tdm_output_commit failed.\n");
+		swapchain_tdm->commit_pending = VK_FALSE;
+		res = VK_ERROR_SURFACE_LOST_KHR;
+	}
+
+	if (swapchain_tdm_wait_commit(swapchain_tdm) != VK_SUCCESS)
+		res = VK_ERROR_SURFACE_LOST_KHR;
+
+	pthread_mutex_unlock(&swapchain_tdm->pdev->tdm_mutex);
+
+	if (res != VK_SUCCESS)
+		return res;
+
+	return swapchain_tdm_finish_image(chain, tbm_surface);
+}
+
+static void
+swapchain_tdm_group_present_prepare(vk_swapchain_t *chain, vk_present_context_t *ctx);
+
+/* Returns the backend data of the ith swapchain of the present if it is a group member with a
+ * staged buffer. */
+static vk_swapchain_tdm_t *
+swapchain_tdm_group_staged(vk_present_context_t *ctx, uint32_t i)
+{
+	vk_swapchain_t		*chain = (vk_swapchain_t *)(uintptr_t)ctx->swapchains[i];
+	vk_swapchain_tdm_t	*swapchain_tdm = chain->backend_data;
+
+	if (chain->present_prepare != swapchain_tdm_group_present_prepare || !swapchain_tdm->staged)
+		return NULL;
+
+	return swapchain_tdm;
+}
+
+static void
+swapchain_tdm_group_commit_cb(tdm_output *output, unsigned int sequence,
+							  unsigned int tv_sec, unsigned int tv_usec,
+							  void *user_data)
+{
+	vk_present_context_t	*ctx = user_data;
+	uint32_t				 i;
+
+	/* Members on this output which were not presented did not commit anything. */
+	for (i = 0; i < ctx->swapchain_count; i++) {
+		vk_swapchain_tdm_t *swapchain_tdm = swapchain_tdm_group_staged(ctx, i);
+
+		if (swapchain_tdm && swapchain_tdm->tdm_output == output)
+			swapchain_tdm_output_commit_cb(output, sequence, tv_sec, tv_usec,
+										   (vk_swapchain_t *)(uintptr_t)ctx->swapchains[i]);
+	}
+}
+
+/* Commits every output with a buffer staged by the present once, then finishes the staged
+ * buffers. Called with the context mutex held. Members come from the same device, so they share
+ * one tdm_mutex.
+ *
+ * TDM has no atomic commit across outputs: each tdm_output_commit() flips its output on the
+ * next vblank of that output, and outputs are not synchronised to each other. All outputs are
+ * committed before waiting for any flip, so each of them flips on its next vblank, but the
+ * flips of different outputs are not guaranteed to land on the same vblank. */
+static VkResult
+swapchain_tdm_group_commit(vk_present_context_t *ctx)
+{
+	VkResult					 res = VK_SUCCESS;
+	tdm_error					 tdm_err;
+	pthread_mutex_t				*tdm_mutex = NULL;
+	uint32_t					 i, j;
+
+	for (i = 0; i < ctx->swapchain_count; i++) {
+		vk_swapchain_tdm_t *swapchain_tdm = swapchain_tdm_group_staged(ctx, i);
+
+		if (!swapchain_tdm)
+			continue;
+
+		if (!tdm_mutex) {
+			tdm_mutex = &swapchain_tdm->pdev->tdm_mutex;
+			pthread_mutex_lock(tdm_mutex);
+		}
+
+		swapchain_tdm->commit_pending = VK_TRUE;
+	}
+
+	for (i = 0; i < ctx->swapchain_count; i++) {
+		vk_swapchain_tdm_t *swapchain_tdm = swapchain_tdm_group_staged(ctx, i);
+
+		if (!swapchain_tdm)
+			continue;
+
+		/* Layers on the same output go with its first staged member. */
+		for (j = 0; j < i; j++) {
+			vk_swapchain_tdm_t *prev = swapchain_tdm_group_staged(ctx, j);
+
+			if (prev && prev->tdm_output == swapchain_tdm->tdm_output)
+				break;
+		}
+
+		if (j < i)
+			continue;
+
+		VK_TRACE_BEGIN("tdm_output_commit");
+		tdm_err = tdm_output_commit(swapchain_tdm->tdm_output, 0,
+									swapchain_tdm_group_commit_cb, ctx);
+		VK_TRACE_END("tdm_output_commit");
+
+		if (tdm_err != TDM_ERROR_NONE) {
+			VK_ERROR("tdm_output_commit failed.\n");
+			res = VK_ERROR_SURFACE_LOST_KHR;
+
+			/* No callback comes for the members on this output. */
+			for (j = i; j < ctx->swapchain_count; j++) {
+				vk_swapchain_tdm_t *next = swapchain_tdm_group_staged(ctx, j);
+
+				if (next && next->tdm_output == swapchain_tdm->tdm_output)
+					next->commit_pending = VK_FALSE;
+			}
+		}
+	}
+
+	for (i = 0; i < ctx->swapchain_count; i++) {
+		vk_swapchain_tdm_t *swapchain_tdm = swapchain_tdm_group_staged(ctx, i);
+
+		if (swapchain_tdm && swapchain_tdm_wait_commit(swapchain_tdm) != VK_SUCCESS)
+			res = VK_ERROR_SURFACE_LOST_KHR;
+	}
+
+	if (tdm_mutex)
+		pthread_mutex_unlock(tdm_mutex);
+
+	for (i = 0; i < ctx->swapchain_count; i++) {
+		vk_swapchain_tdm_t *swapchain_tdm = swapchain_tdm_group_staged(ctx, i);
+
+		if (!swapchain_tdm)
+			continue;
+
+		if (swapchain_tdm_finish_image((vk_swapchain_t *)(uintptr_t)ctx->swapchains[i],
+									   swapchain_tdm->staged) != VK_SUCCESS)
+			res = VK_ERROR_SURFACE_LOST_KHR;
+
+		swapchain_tdm->staged = NULL;
+	}
+
+	return res;
+}
+
+static void
+swapchain_tdm_group_present_prepare(vk_swapchain_t *chain, vk_present_context_t *ctx)
+{
+	vk_swapchain_tdm_t *swapchain_tdm = chain->backend_data;
+
+	/* A swapchain is in a single present at a time, the application synchronises that. */
+	swapchain_tdm->present_ctx = ctx;
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->expected++;
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+/* Counts a member as done with the present, and commits once all of them are. Called with the
+ * context mutex held. */
+static VkResult
+swapchain_tdm_group_count(vk_present_context_t *ctx)
+{
+	if (++ctx->done < ctx->expected)
+		return VK_SUCCESS;
+
+	return swapchain_tdm_group_commit(ctx);
+}
+
+static VkResult
+swapchain_tdm_group_present_image(VkQueue			 queue,
+								  vk_swapchain_t	*chain,
+								  tbm_surface_h		 tbm_surface,
+								  int				 sync_fd,
+								  const VkPresentRegionKHR	*region,
+								  uint64_t			 desired_time)
+{
+	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
+	vk_present_context_t		*ctx = swapchain_tdm->present_ctx;
+	tbm_surface_h				 staged = NULL;
+	VkResult					 res;
+
+	res = swapchain_tdm_stage_image(chain, tbm_surface, sync_fd, desired_time, &staged);
+
+	pthread_mutex_lock(&ctx->mutex);
+
+	if (res == VK_SUCCESS)
+		swapchain_tdm->staged = staged;
+
+	/* A member failing to stage still counts, the others must not be held back by it. */
+	if (swapchain_tdm_group_count(ctx) != VK_SUCCESS && res == VK_SUCCESS)
+		res = VK_ERROR_SURFACE_LOST_KHR;
+
+	pthread_mutex_unlock(&ctx->mutex);
+
+	swapchain_tdm->present_ctx = NULL;
+	return res;
+}
+
+static void
+swapchain_tdm_group_present_skip(vk_swapchain_t *chain)
+{
+	vk_swapchain_tdm_t		*swapchain_tdm = chain->backend_data;
+	vk_present_context_t	*ctx = swapchain_tdm->present_ctx;
+
+	pthread_mutex_lock(&ctx->mutex);
+	swapchain_tdm_group_count(ctx);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	swapchain_tdm->present_ctx = NULL;
+}
+
+vk_swapchain_tdm_group_t *
+swapchain_tdm_group_create(const VkAllocationCallbacks *allocator, uint32_t member_count)
+{
+	vk_swapchain_tdm_group_t *group;
+
+	group = vk_alloc(allocator,
+					 sizeof(vk_swapchain_tdm_group_t) + member_count * sizeof(vk_swapchain_t *),
+					 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+	VK_CHECK(group, return NULL, "vk_alloc() failed.\n");
+
+	memset(group, 0x00, sizeof(vk_swapchain_tdm_group_t) + member_count * sizeof(vk_swapchain_t *));
+	group->allocator = *allocator;
+	group->member_count = member_count;
+	group->ref_count = 1;
+	pthread_mutex_init(&group->mutex, NULL);
+
+	return group;
+}
+
+void
+swapchain_tdm_group_unref(vk_swapchain_tdm_group_t *group)
+{
+	uint32_t ref_count;
+
+	pthread_mutex_lock(&group->mutex);
+	ref_count = --group->ref_count;
+	pthread_mutex_unlock(&group->mutex);
+
+	if (ref_count)
+		return;
+
+	pthread_mutex_destroy(&group->mutex);
+	vk_free(&group->allocator, group);
+}
+
+void
+swapchain_tdm_group_join(vk_swapchain_tdm_group_t *group, vk_swapchain_t *chain, uint32_t index)
+{
+	vk_swapchain_tdm_t *swapchain_tdm = chain->backend_data;
+
+	pthread_mutex_lock(&group->mutex);
+	group->members[index] = chain;
+	group->ref_count++;
+	pthread_mutex_unlock(&group->mutex);
+
+	swapchain_tdm->group = group;
+	chain->present_prepare = swapchain_tdm_group_present_prepare;
+	chain->present_skip = swapchain_tdm_group_present_skip;
+	chain->present_image = swapchain_tdm_group_present_image;
+}
+
+static void
+swapchain_tdm_group_leave(vk_swapchain_t *chain)
+{
+	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
+	vk_swapchain_tdm_group_t	*group = swapchain_tdm->group;
+	uint32_t					 i;
+
+	pthread_mutex_lock(&group->mutex);
+	for (i = 0; i < group->member_count; i++) {
+		if (group->members[i] == chain)
+			group->members[i] = NULL;
+	}
+	pthread_mutex_unlock(&group->mutex);
+
+	swapchain_tdm->group = NULL;
+	swapchain_tdm_group_unref(group);
+}
+
 static void
 swapchain_tdm_timeline_destroy_cb(void *user_data)
 {
@@ -245,7 +692,9 @@ swapchain_tdm_acquire_next_image(VkDevice			 device,
 		}
 	}
 
+	VK_TRACE_BEGIN("tbm_surface_queue_dequeue");
 	tsq_err = tbm_surface_queue_dequeue(swapchain_tdm->tbm_queue, tbm_surface);
+	VK_TRACE_END("tbm_surface_queue_dequeue");
 	VK_CHECK(tsq_err == TBM_SURFACE_QUEUE_ERROR_NONE, return VK_ERROR_SURFACE_LOST_KHR,
 			 "tbm_surface_queue_dequeue failed.\n");
 	pthread_mutex_unlock(&swapchain_tdm->free_queue_mutex);
@@ -256,6 +705,23 @@ swapchain_tdm_acquire_next_image(VkDevice			 device,
 	return VK_SUCCESS;
 }
 
+static void
+swapchain_tdm_cancel_image(vk_swapchain_t *chain, tbm_surface_h tbm_surface)
+{
+	tbm_surface_queue_error_e	 tsq_err;
+	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
+
+	if (pthread_mutex_lock(&swapchain_tdm->free_queue_mutex))
+		VK_ERROR("pthread_mutex_lock free queue failed\n");
+
+	tsq_err = tbm_surface_queue_cancel_dequeue(swapchain_tdm->tbm_queue, tbm_surface);
+	if (tsq_err != TBM_SURFACE_QUEUE_ERROR_NONE)
+		VK_ERROR("tbm_surface_queue_cancel_dequeue failed.\n");
+
+	pthread_mutex_unlock(&swapchain_tdm->free_queue_mutex);
+	pthread_cond_signal(&swapchain_tdm->free_queue_cond);
+}
+
 static void
 swapchain_tdm_deinit(VkDevice		 device,
 					 vk_swapchain_t *chain)
@@ -263,6 +729,9 @@ swapchain_tdm_deinit(VkDevice		 device,
 	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
 
 	if (swapchain_tdm) {
+		if (swapchain_tdm->group)
+			swapchain_tdm_group_leave(chain);
+
 		tdm_output_set_dpms(swapchain_tdm->tdm_output, swapchain_tdm->tdm_dpms);
 
 		pthread_cond_destroy(&swapchain_tdm->free_queue_cond);
@@ -272,9 +741,8 @@ swapchain_tdm_deinit(VkDevice		 device,
 		if (swapchain_tdm->tbm_queue)
 			tbm_surface_queue_destroy(swapchain_tdm->tbm_queue);
 
-		if (swapchain_tdm->buffers)
-			vk_free(&chain->allocator, swapchain_tdm->buffers);
-		vk_free(&chain->allocator, swapchain_tdm);
+		vk_swapchain_free(chain, swapchain_tdm->buffers);
+		vk_swapchain_free(chain, swapchain_tdm);
 	}
 }
 
@@ -292,10 +760,8 @@ swapchain_tdm_get_buffers(VkDevice			 device,
 	vk_swapchain_tdm_t			*swapchain_tdm = chain->backend_data;
 
 	*buffer_count = tbm_surface_queue_get_size(swapchain_tdm->tbm_queue);
-	swapchain_tdm->buffers = vk_alloc(&chain->allocator,
-											   sizeof(tbm_surface_h) * *buffer_count,
-											   VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
-	VK_CHECK(swapchain_tdm->buffers, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
+	swapchain_tdm->buffers = vk_swapchain_alloc(chain, sizeof(tbm_surface_h) * *buffer_count);
+	VK_CHECK(swapchain_tdm->buffers, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_swapchain_alloc() failed.\n");
 
 	for (i = 0; i < *buffer_count; i++) {
 		tsq_err = tbm_surface_queue_dequeue(swapchain_tdm->tbm_queue,
@@ -357,6 +823,14 @@ swapchain_tdm_get_buffers(VkDevice			 device,
 	return VK_SUCCESS;
 }
 
+size_t
+swapchain_tdm_arena_size(const VkSwapchainCreateInfoKHR *info)
+{
+	/* The tbm queue is created with minImageCount buffers. */
+	return VK_ALLOC_SIZE(sizeof(vk_swapchain_tdm_t)) +
+		   VK_ALLOC_SIZE(sizeof(tbm_surface_h) * info->minImageCount);
+}
+
 VkResult
 swapchain_tdm_init(VkDevice							 device,
 				   const VkSwapchainCreateInfoKHR	*info,
@@ -368,14 +842,14 @@ swapchain_tdm_init(VkDevice							 device,
 	vk_display_t		*disp = disp_mode->display;
 	vk_swapchain_tdm_t	*swapchain_tdm;
 
-	swapchain_tdm = vk_alloc(&chain->allocator, sizeof(vk_swapchain_tdm_t),
-							 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
-	VK_CHECK(swapchain_tdm, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
+	swapchain_tdm = vk_swapchain_alloc(chain, sizeof(vk_swapchain_tdm_t));
+	VK_CHECK(swapchain_tdm, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_swapchain_alloc() failed.\n");
 
 	memset(swapchain_tdm, 0x00, sizeof(*swapchain_tdm));
 	chain->backend_data = swapchain_tdm;
 
 	swapchain_tdm->tdm_display = disp->pdev->tdm_display;
+	swapchain_tdm->pdev = disp->pdev;
 	swapchain_tdm->tdm_output = disp->tdm_output;
 	swapchain_tdm->tdm_layer = disp->pdev->planes[surface->planeIndex].tdm_layer;
 
@@ -406,7 +880,9 @@ swapchain_tdm_init(VkDevice							 device,
 	chain->get_buffers = swapchain_tdm_get_buffers;
 	chain->deinit = swapchain_tdm_deinit;
 	chain->acquire_image = swapchain_tdm_acquire_next_image;
+	chain->cancel_image = swapchain_tdm_cancel_image;
 	chain->present_image = swapchain_tdm_queue_present_image;
+	chain->get_refresh_duration = swapchain_tdm_get_refresh_duration;
 
 	return VK_SUCCESS;
 }
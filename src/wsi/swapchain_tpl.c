@@ -34,17 +34,79 @@ struct vk_swapchain_tpl {
 	tbm_surface_h			*buffers;
 };
 
+/* Damage rectangles passed to tpl, beyond which the whole surface is reported damaged. */
+#define SWAPCHAIN_TPL_MAX_DAMAGE_RECTS	16
+
 static VkResult
 swapchain_tpl_queue_present_image(VkQueue					 queue,
 								  vk_swapchain_t			*chain,
 								  tbm_surface_h				 tbm_surface,
-								  int						 sync_fd)
+								  int						 sync_fd,
+								  const VkPresentRegionKHR	*region,
+								  uint64_t					 desired_time)
 {
 	tpl_result_t		 res;
 	vk_swapchain_tpl_t	*swapchain_tpl = chain->backend_data;
+	int					 rects[SWAPCHAIN_TPL_MAX_DAMAGE_RECTS * 4];
+	int					 num_rects = 0;
+	int32_t				 width = chain->info.imageExtent.width;
+	int32_t				 height = chain->info.imageExtent.height;
+	int32_t				 box_x0 = width, box_y0 = height, box_x1 = 0, box_y1 = 0;
+	vk_bool_t			 too_many;
+	uint32_t			 i;
+
+	/* No rectangles means the whole image changed. Beyond the rectangles tpl is given, their
+	 * bounding box is reported instead. */
+	if (region && region->rectangleCount > 0) {
+		too_many = region->rectangleCount > SWAPCHAIN_TPL_MAX_DAMAGE_RECTS;
+
+		for (i = 0; i < region->rectangleCount; i++) {
+			const VkRectLayerKHR	*rect = &region->pRectangles[i];
+			int32_t					 x0 = MAX(rect->offset.x, 0);
+			int32_t					 y0 = MAX(rect->offset.y, 0);
+			int32_t					 x1 = MIN((int64_t)rect->offset.x + rect->extent.width, width);
+			int32_t					 y1 = MIN((int64_t)rect->offset.y + rect->extent.height, height);
+
+			if (x0 >= x1 || y0 >= y1)
+				continue;
+
+			if (too_many) {
+				box_x0 = MIN(box_x0, x0);
+				box_y0 = MIN(box_y0, y0);
+				box_x1 = MAX(box_x1, x1);
+				box_y1 = MAX(box_y1, y1);
+				continue;
+			}
+
+			/* tpl takes damage with the origin at the bottom left, like EGL. */
+			rects[num_rects * 4 + 0] = x0;
+			rects[num_rects * 4 + 1] = height - y1;
+			rects[num_rects * 4 + 2] = x1 - x0;
+			rects[num_rects * 4 + 3] = y1 - y0;
+			num_rects++;
+		}
+
+		if (too_many && box_x0 < box_x1 && box_y0 < box_y1) {
+			rects[0] = box_x0;
+			rects[1] = height - box_y1;
+			rects[2] = box_x1 - box_x0;
+			rects[3] = box_y1 - box_y0;
+			num_rects = 1;
+		}
+
+		/* Nothing inside the surface changed, but the buffer is still presented. Report a single
+		 * empty rectangle rather than none, which would mean all of it. */
+		if (num_rects == 0) {
+			memset(rects, 0x00, 4 * sizeof(int));
+			num_rects = 1;
+		}
+	}
 
+	VK_TRACE_BEGIN("tpl_surface_enqueue_buffer");
 	res = tpl_surface_enqueue_buffer_with_damage_and_sync(swapchain_tpl->tpl_surface,
-														  tbm_surface, 0, NULL, sync_fd);
+														  tbm_surface, num_rects,
+														  num_rects ? rects : NULL, sync_fd);
+	VK_TRACE_END("tpl_surface_enqueue_buffer");
 	return res == TPL_ERROR_NONE ? VK_SUCCESS : VK_ERROR_DEVICE_LOST;
 }
 
@@ -57,19 +119,36 @@ swapchain_tpl_acquire_next_image(VkDevice			 device,
 {
 	vk_swapchain_tpl_t	*swapchain_tpl = chain->backend_data;
 
-	if (sync) {
+	VK_TRACE_BEGIN("tpl_surface_dequeue_buffer");
+
+	if (sync)
 		*tbm_surface = tpl_surface_dequeue_buffer_with_sync(swapchain_tpl->tpl_surface,
 															timeout, sync);
+	else
+		*tbm_surface = tpl_surface_dequeue_buffer(swapchain_tpl->tpl_surface);
+
+	VK_TRACE_END("tpl_surface_dequeue_buffer");
+
+	if (sync) {
 		if (*tbm_surface == NULL)
 			return VK_TIMEOUT;
 	} else {
-		*tbm_surface = tpl_surface_dequeue_buffer(swapchain_tpl->tpl_surface);
 		VK_CHECK(*tbm_surface, return VK_ERROR_SURFACE_LOST_KHR, "tpl_surface_dequeue_buffers() failed.\n");
 	}
 
 	return VK_SUCCESS;
 }
 
+static void
+swapchain_tpl_cancel_image(vk_swapchain_t *chain, tbm_surface_h tbm_surface)
+{
+	vk_swapchain_tpl_t	*swapchain_tpl = chain->backend_data;
+	tpl_result_t		 res;
+
+	res = tpl_surface_cancel_dequeued_buffer(swapchain_tpl->tpl_surface, tbm_surface);
+	VK_CHECK(res == TPL_ERROR_NONE, return, "tpl_surface_cancel_dequeued_buffer() failed.\n");
+}
+
 static void
 swapchain_tpl_deinit(VkDevice		 device,
 				 vk_swapchain_t *chain)
@@ -87,7 +166,7 @@ swapchain_tpl_deinit(VkDevice		 device,
 
 		if (swapchain_tpl->buffers)
 			free(swapchain_tpl->buffers);
-		vk_free(&chain->allocator, swapchain_tpl);
+		vk_swapchain_free(chain, swapchain_tpl);
 	}
 }
 
@@ -119,6 +198,13 @@ done:
 	return error;
 }
 
+size_t
+swapchain_tpl_arena_size(const VkSwapchainCreateInfoKHR *info)
+{
+	/* The buffer array is allocated by tpl. */
+	return VK_ALLOC_SIZE(sizeof(vk_swapchain_tpl_t));
+}
+
 VkResult
 swapchain_tpl_init(VkDevice							 device,
 				   const VkSwapchainCreateInfoKHR	*info,
@@ -133,9 +219,8 @@ swapchain_tpl_init(VkDevice							 device,
 
 	VkResult error = VK_ERROR_DEVICE_LOST;
 
-	swapchain_tpl = vk_alloc(&chain->allocator, sizeof(vk_swapchain_tpl_t),
-							 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
-	VK_CHECK(swapchain_tpl, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_alloc() failed.\n");
+	swapchain_tpl = vk_swapchain_alloc(chain, sizeof(vk_swapchain_tpl_t));
+	VK_CHECK(swapchain_tpl, return VK_ERROR_OUT_OF_HOST_MEMORY, "vk_swapchain_alloc() failed.\n");
 	memset(swapchain_tpl, 0x00, sizeof(*swapchain_tpl));
 	chain->backend_data = swapchain_tpl;
 
@@ -181,6 +266,7 @@ swapchain_tpl_init(VkDevice							 device,
 	chain->get_buffers = swapchain_tpl_get_buffers;
 	chain->deinit = swapchain_tpl_deinit;
 	chain->acquire_image = swapchain_tpl_acquire_next_image;
+	chain->cancel_image = swapchain_tpl_cancel_image;
 	chain->present_image = swapchain_tpl_queue_present_image;
 
 	return VK_SUCCESS;
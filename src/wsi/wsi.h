@@ -29,6 +29,7 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vk_tizen.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <vulkan/vk_icd.h>
 #include <utils.h>
 #include <tpl.h>
@@ -48,12 +49,19 @@ typedef struct vk_display			vk_display_t;
 typedef struct vk_display_plane		vk_display_plane_t;
 typedef struct vk_display_mode		vk_display_mode_t;
 typedef struct vk_icd				vk_icd_t;
+typedef struct vk_instance			vk_instance_t;
+typedef struct vk_device			vk_device_t;
 typedef struct vk_tbm_queue_surface	vk_tbm_queue_surface_t;
+typedef struct vk_early_acquire		vk_early_acquire_t;
+typedef struct vk_swapchain_tdm_group	vk_swapchain_tdm_group_t;
+typedef struct vk_present_context		vk_present_context_t;
+typedef struct vk_present_timing		vk_present_timing_t;
 
 struct vk_icd {
 	void	*lib;
 
 	PFN_vkGetInstanceProcAddr					get_proc_addr;
+	PFN_vkGetInstanceProcAddr					gipa;
 	PFN_vkEnumerateDeviceExtensionProperties	enum_dev_exts;
 
 	uint32_t				 instance_extension_count;
@@ -71,6 +79,34 @@ vk_get_icd(void);
 vk_physical_device_t *
 vk_get_physical_device(VkPhysicalDevice pdev);
 
+/* ICD proc addr functions are resolved once per dispatchable object and cached here. */
+struct vk_instance {
+	VkInstance					 instance;
+	PFN_vkGetInstanceProcAddr	 gipa;
+	VkAllocationCallbacks		 allocator;
+
+	/* Physical devices enumerated through this instance, protected by the registry mutex. */
+	vk_physical_device_t		*physical_devices;
+};
+
+struct vk_device {
+	VkDevice					 device;
+	PFN_vkGetDeviceProcAddr		 gdpa;
+	VkAllocationCallbacks		 allocator;
+
+	/* ICD device functions used by the WSI, resolved when the device is first seen. */
+	PFN_vkDestroyImage						destroy_image;
+	PFN_vkCreateImageFromNativeBufferTIZEN	create_presentable_image;
+	PFN_vkQueueSignalReleaseImageTIZEN		queue_signal_release_image;
+	PFN_vkAcquireImageTIZEN					acquire_image;
+};
+
+vk_instance_t *
+vk_get_instance(VkInstance instance);
+
+vk_device_t *
+vk_get_device(VkDevice device);
+
 struct vk_display {
 	vk_physical_device_t	*pdev;
 
@@ -108,8 +144,31 @@ struct vk_display_mode {
 struct vk_physical_device {
 	VkPhysicalDevice	 pdev;
 
+	/* Parent instance if the physical device was enumerated through the WSI, NULL otherwise. */
+	vk_instance_t					*instance;
+	const VkAllocationCallbacks		*allocator;
+	vk_physical_device_t			*next;		/* In the instance's list. */
+
+	/* Protects lazily built state below. */
+	pthread_mutex_t		 mutex;
+
+	/* Merged ICD and WSI device extensions, built on the first enumeration. Lists for named
+	 * layers are kept in layer_extensions keyed by the layer name. */
+	void				*extensions;
+	vk_map_t			*layer_extensions;
+
+	/* Display state below is built on the first display query, see
+	 * vk_physical_device_get_display(). */
+	vk_bool_t			 display_initialized;
+
 	tdm_display			*tdm_display;
 
+	/* Serialises commits and event dispatch on tdm_display between presenting threads, see
+	 * vk_physical_device_wait_tdm_commit(). */
+	pthread_mutex_t		 tdm_mutex;
+	pthread_cond_t		 tdm_cond;
+	vk_bool_t			 tdm_dispatching;
+
 	uint32_t			 display_count;
 	vk_display_t		 displays[VK_MAX_DISPLAY_COUNT];
 
@@ -122,9 +181,33 @@ struct vk_buffer {
 	VkImage			image;
 };
 
+/* One vkQueuePresentKHR() call, handed to present_prepare. Backends presenting several of its
+ * swapchains together count them here rather than in the swapchains, which other calls may be
+ * presenting at the same time. */
+struct vk_present_context {
+	const VkSwapchainKHR	*swapchains;
+	uint32_t				 swapchain_count;
+
+	pthread_mutex_t			 mutex;
+	uint32_t				 expected;	/* Swapchains prepared. */
+	uint32_t				 done;		/* Of those, presented or skipped so far. */
+};
+
+/* Presents recorded per swapchain for VK_GOOGLE_display_timing, pending and completed. */
+#define VK_PRESENT_TIMING_HISTORY	32
+
+struct vk_present_timing {
+	uint32_t	present_id;
+	vk_bool_t	reported;		/* The application gave a present ID. */
+	uint64_t	desired;
+	uint64_t	actual;
+	uint64_t	queued;			/* When the commit was issued. */
+};
+
 struct vk_swapchain {
 	VkAllocationCallbacks	 allocator;
 	VkSurfaceKHR			 surface;
+	vk_device_t				*dev;
 
 	VkResult				(*get_buffers)	(VkDevice,
 											 vk_swapchain_t *,
@@ -138,14 +221,69 @@ struct vk_swapchain {
 	VkResult				(*present_image)(VkQueue,
 											 vk_swapchain_t *,
 											 tbm_surface_h,
-											 int);			/* sync fd */
+											 int,			/* sync fd */
+											 const VkPresentRegionKHR *,	/* damage */
+											 uint64_t);		/* desired present time */
 	void					(*deinit)		(VkDevice,
 											 vk_swapchain_t *);
 
+	/* Gives a dequeued buffer back to the backend without presenting it. */
+	void					(*cancel_image)	(vk_swapchain_t *,
+											 tbm_surface_h);
+
+	/* Optional, called for every swapchain of a vkQueuePresentKHR() before any is presented.
+	 * Each of them then gets either present_image or present_skip. */
+	void					(*present_prepare)(vk_swapchain_t *, vk_present_context_t *);
+	void					(*present_skip)(vk_swapchain_t *);
+
+	/* Optional, refresh duration of the display in ns. Backends providing it report the flip
+	 * time of every present through vk_swapchain_timing_done(). */
+	uint64_t				(*get_refresh_duration)(vk_swapchain_t *);
+
 	uint32_t				 buffer_count;
 	vk_buffer_t				*buffers;
 
+	/* tbm_surface_h -> image index + 1. */
+	vk_map_t				 buffer_index;
+
+	/* Images still being created by the work pool, see swapchain_wait_image(). images_ready is
+	 * set once all of them were created. */
+	vk_work_group_t			 image_group;
+	void					*image_works;
+	vk_bool_t				 images_ready;
+
 	void *backend_data;
+
+	/* Presents in timing[], oldest first: [timing_read, timing_done) have completed and
+	 * [timing_done, timing_queued) wait for their flip. */
+	pthread_mutex_t			 timing_mutex;
+	uint32_t				 timing_read;
+	uint32_t				 timing_done;
+	uint32_t				 timing_queued;
+	uint64_t				 timing_last;	/* Latest flip time, 0 before the first. */
+	vk_present_timing_t		 timing[VK_PRESENT_TIMING_HISTORY];
+
+	/* Early acquire state, NULL when images are acquired synchronously from the backend. */
+	vk_early_acquire_t		*early;
+
+	/* Parameters the swapchain was created with, without the pointers, to tell whether a
+	 * recreation can keep its buffers. */
+	VkSwapchainCreateInfoKHR info;
+
+	/* Set once the swapchain was passed as oldSwapchain. */
+	vk_bool_t				 retired;
+
+	/* A swapchain recreated with compatible parameters shares the backend, buffers and images of
+	 * the one it replaces. They live in the root's allocation and are torn down once the last
+	 * swapchain using them is destroyed, ref_count of the root counts those. NULL for a root. */
+	vk_swapchain_t			*root;
+	uint32_t				 ref_count;
+
+	/* Arena following the swapchain in the same allocation. The backend data and the buffer
+	 * arrays are carved from it, see vk_swapchain_alloc(). */
+	size_t					 arena_size;
+	size_t					 arena_used;
+	char					*arena;
 };
 
 struct vk_tbm_queue_surface {
@@ -157,22 +295,80 @@ struct vk_tbm_queue_surface {
 VkBool32
 vk_physical_device_init_display(vk_physical_device_t *pdev);
 
+vk_physical_device_t *
+vk_physical_device_get_display(VkPhysicalDevice pdev);
+
+VkResult
+vk_physical_device_wait_tdm_commit(vk_physical_device_t *pdev, vk_bool_t *pending);
+
+void
+vk_physical_device_fini_extensions(vk_physical_device_t *pdev);
+
 void
 vk_physical_device_fini_display(vk_physical_device_t *pdev);
 
+/* Alignment requested from allocation callbacks. Applications may hand out memory aligned to no
+ * more than what they are asked for, so ask for what our structures need. */
+#define VK_ALLOC_ALIGNMENT	(2 * sizeof(void *))
+#define VK_ALLOC_SIZE(size)	(((size) + VK_ALLOC_ALIGNMENT - 1) & ~(VK_ALLOC_ALIGNMENT - 1))
+
 const VkAllocationCallbacks *
 vk_get_allocator(void *parent, const VkAllocationCallbacks *allocator);
 
+const VkAllocationCallbacks *
+vk_get_parent_allocator(void *parent);
+
+/* vk_alloc() and vk_realloc() record their call site for allocation statistics. */
+#define VK_ALLOC_STRINGIFY(x)	#x
+#define VK_ALLOC_SITE_LINE(x)	VK_ALLOC_STRINGIFY(x)
+#define VK_ALLOC_SITE			__FILE__ ":" VK_ALLOC_SITE_LINE(__LINE__)
+
+#define vk_alloc(allocator, size, scope)					\
+	vk_alloc_site(allocator, size, scope, VK_ALLOC_SITE)
+
+#define vk_realloc(allocator, mem, size, scope)				\
+	vk_realloc_site(allocator, mem, size, scope, VK_ALLOC_SITE)
+
 void *
-vk_alloc(const VkAllocationCallbacks *allocator, size_t size, VkSystemAllocationScope scope);
+vk_alloc_site(const VkAllocationCallbacks *allocator, size_t size, VkSystemAllocationScope scope,
+			  const char *site);
 
 void *
-vk_realloc(const VkAllocationCallbacks *allocator, void *mem, size_t size,
-		   VkSystemAllocationScope scope);
+vk_realloc_site(const VkAllocationCallbacks *allocator, void *mem, size_t size,
+				VkSystemAllocationScope scope, const char *site);
 
 void
 vk_free(const VkAllocationCallbacks *allocator, void *mem);
 
+/* Allocation statistics, collected when VK_TIZEN_ALLOC_STATS is set in the environment. Sizes
+ * are bucketed by power of two, the first bucket holding allocations up to 16 bytes. */
+#define VK_ALLOC_STATS_BUCKET_COUNT	16
+
+typedef struct vk_alloc_stats	vk_alloc_stats_t;
+
+struct vk_alloc_stats {
+	uint64_t	live_bytes;
+	uint64_t	peak_bytes;
+	uint64_t	alloc_count;
+	uint64_t	realloc_count;
+	uint64_t	free_count;
+	uint64_t	histogram[VK_ALLOC_STATS_BUCKET_COUNT];
+};
+
+vk_bool_t
+vk_alloc_stats_enabled(void);
+
+/* Statistics of one allocation scope, or of all of them for VK_SYSTEM_ALLOCATION_SCOPE_MAX_ENUM. */
+vk_bool_t
+vk_alloc_stats_get(VkSystemAllocationScope scope, vk_alloc_stats_t *stats);
+
+/* Fills up to count call sites and returns the number of recorded ones. */
+uint32_t
+vk_alloc_stats_get_sites(uint32_t count, const char **sites, vk_alloc_stats_t *stats);
+
+void
+vk_alloc_stats_dump(void);
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch"
 static inline tpl_display_t *
@@ -217,14 +413,57 @@ vk_get_tpl_native_window(VkIcdSurfaceBase		*sfc)
 }
 #pragma GCC diagnostic pop
 
+void *
+vk_swapchain_alloc(vk_swapchain_t *chain, size_t size);
+
+void
+vk_swapchain_free(vk_swapchain_t *chain, void *mem);
+
+void
+vk_swapchain_timing_queue(vk_swapchain_t *chain, const VkPresentTimeGOOGLE *time);
+
+void
+vk_swapchain_timing_done(vk_swapchain_t *chain, uint64_t actual);
+
+vk_early_acquire_t *
+vk_early_acquire_create(VkDevice device, vk_swapchain_t *chain);
+
+void
+vk_early_acquire_destroy(vk_early_acquire_t *early);
+
+VkResult
+vk_early_acquire_next(vk_early_acquire_t *early, uint64_t timeout, uint32_t *image_index,
+					  int *sync);
+
+VkResult
+vk_early_acquire_wait_dequeued(vk_early_acquire_t *early, uint32_t image_index);
+
+void
+vk_early_acquire_presented(vk_early_acquire_t *early, uint32_t image_index);
+
+size_t
+swapchain_tpl_arena_size(const VkSwapchainCreateInfoKHR *info);
+
 VkResult
 swapchain_tpl_init(VkDevice device, const VkSwapchainCreateInfoKHR *info,
 				   vk_swapchain_t *chain, tbm_format format);
 
+size_t
+swapchain_tdm_arena_size(const VkSwapchainCreateInfoKHR *info);
+
 VkResult
 swapchain_tdm_init(VkDevice device, const VkSwapchainCreateInfoKHR *info,
 				   vk_swapchain_t *chain, tbm_format format);
 
+vk_swapchain_tdm_group_t *
+swapchain_tdm_group_create(const VkAllocationCallbacks *allocator, uint32_t member_count);
+
+void
+swapchain_tdm_group_unref(vk_swapchain_tdm_group_t *group);
+
+void
+swapchain_tdm_group_join(vk_swapchain_tdm_group_t *group, vk_swapchain_t *chain, uint32_t index);
+
 /* Entry point proto types. */
 VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
 vk_icdGetInstanceProcAddr(VkInstance instance, const char *name);
@@ -294,6 +533,14 @@ vk_CreateSharedSwapchainsKHR(VkDevice device, uint32_t swapchain_count,
 							 const VkSwapchainCreateInfoKHR *infos,
 							 const VkAllocationCallbacks *allocator, VkSwapchainKHR *swapchains);
 
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_GetRefreshCycleDurationGOOGLE(VkDevice device, VkSwapchainKHR swapchain,
+								 VkRefreshCycleDurationGOOGLE *properties);
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_GetPastPresentationTimingGOOGLE(VkDevice device, VkSwapchainKHR swapchain,
+								   uint32_t *timing_count, VkPastPresentationTimingGOOGLE *timings);
+
 VKAPI_ATTR VkBool32 VKAPI_CALL
 vk_GetPhysicalDeviceWaylandPresentationSupportKHR(VkPhysicalDevice pdev,
 												  uint32_t queue_family_index,
@@ -305,6 +552,23 @@ vk_GetInstanceProcAddr(VkInstance instance, const char *name);
 VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
 vk_GetDeviceProcAddr(VkDevice device, const char *name);
 
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_CreateInstance(const VkInstanceCreateInfo *info, const VkAllocationCallbacks *allocator,
+				  VkInstance *instance);
+
+VKAPI_ATTR void VKAPI_CALL
+vk_DestroyInstance(VkInstance instance, const VkAllocationCallbacks *allocator);
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_EnumeratePhysicalDevices(VkInstance instance, uint32_t *count, VkPhysicalDevice *pdevs);
+
+VKAPI_ATTR VkResult VKAPI_CALL
+vk_CreateDevice(VkPhysicalDevice pdev, const VkDeviceCreateInfo *info,
+				const VkAllocationCallbacks *allocator, VkDevice *device);
+
+VKAPI_ATTR void VKAPI_CALL
+vk_DestroyDevice(VkDevice device, const VkAllocationCallbacks *allocator);
+
 VKAPI_ATTR VkResult VKAPI_CALL
 vk_EnumerateInstanceExtensionProperties(const char *layer_name, uint32_t *count,
 										VkExtensionProperties *extensions);